@@ -1,11 +1,17 @@
 // See LICENSE for license details
 
 #include "blockdev.h"
+#include <algorithm>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <string>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 char blockdev_t::KIND;
 
 /* Block Device Endpoint Driver
@@ -36,17 +42,35 @@ char blockdev_t::KIND;
  * Check if we have been given a file to use as a disk, record size and
  * number of sectors to pass to widget */
 blockdev_t::blockdev_t(simif_t &sim,
+                       StreamEngine &stream,
                        const BLOCKDEVBRIDGEMODULE_struct &mmio_addrs,
                        int blkdevno,
                        const std::vector<std::string> &args,
                        uint32_t num_trackers,
-                       uint32_t latency_bits)
-    : bridge_driver_t(sim, &KIND), mmio_addrs(mmio_addrs) {
+                       uint32_t latency_bits,
+                       int stream_to_cpu_idx,
+                       int stream_to_cpu_depth,
+                       int stream_from_cpu_idx,
+                       int stream_from_cpu_depth)
+    : streaming_bridge_driver_t(sim, stream, &KIND), mmio_addrs(mmio_addrs),
+      blkdevno(blkdevno),
+      stream_to_cpu_idx(stream_to_cpu_idx),
+      stream_to_cpu_depth(stream_to_cpu_depth),
+      stream_from_cpu_idx(stream_from_cpu_idx),
+      stream_from_cpu_depth(stream_from_cpu_depth) {
   this->_file = nullptr;
   this->logfile = nullptr;
   _ntags = num_trackers;
   long size;
   long mem_filesize = 0;
+  bool use_mmap = false;
+  uint32_t io_threads = 0;
+  const char *overlay_name = nullptr;
+  uint32_t readahead_extents = 0;
+  const char *stats_name = nullptr;
+  double stats_interval = 10;
+  uint32_t writeback_mib = 0;
+  double writeback_interval = 1;
 
   const char *logname = nullptr;
 
@@ -59,6 +83,23 @@ blockdev_t::blockdev_t(simif_t &sim,
   std::string blkdevwlatency_arg = std::string("+blkdev-wlatency") + num_equals;
   std::string blkdevrlatency_arg = std::string("+blkdev-rlatency") + num_equals;
   std::string blkdevlog_arg = std::string("+blkdev-log") + num_equals;
+  std::string blkdevmmap_arg = std::string("+blkdev-mmap") + num_equals;
+  std::string blkdevthreads_arg =
+      std::string("+blkdev-io-threads") + num_equals;
+  std::string blkdevoverlay_arg = std::string("+blkdev-overlay") + num_equals;
+  std::string blkdevcommit_arg =
+      std::string("+blkdev-overlay-commit") + num_equals;
+  std::string blkdevreadahead_arg =
+      std::string("+blkdev-readahead") + num_equals;
+  std::string blkdevstats_arg = std::string("+blkdev-stats") + num_equals;
+  std::string blkdevmaxreqlen_arg =
+      std::string("+blkdev-max-req-len") + num_equals;
+  std::string blkdevstatsinterval_arg =
+      std::string("+blkdev-stats-interval") + num_equals;
+  std::string blkdevwriteback_arg =
+      std::string("+blkdev-writeback") + num_equals;
+  std::string blkdevwbinterval_arg =
+      std::string("+blkdev-writeback-interval") + num_equals;
 
   for (auto &arg : args) {
     if (arg.find(blkdev_arg) == 0) {
@@ -80,6 +121,49 @@ blockdev_t::blockdev_t(simif_t &sim,
     if (arg.find(blkdevlog_arg) == 0) {
       logname = const_cast<char *>(arg.c_str()) + blkdevlog_arg.length();
     }
+    // Maps the disk image instead of going through stdio for each request
+    if (arg.find(blkdevmmap_arg) == 0) {
+      use_mmap =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevmmap_arg.length()) != 0;
+    }
+    if (arg.find(blkdevthreads_arg) == 0) {
+      io_threads =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevthreads_arg.length());
+    }
+    // Leaves the image untouched, writes go to a per-run delta file
+    if (arg.find(blkdevoverlay_arg) == 0) {
+      overlay_name =
+          const_cast<char *>(arg.c_str()) + blkdevoverlay_arg.length();
+    }
+    if (arg.find(blkdevcommit_arg) == 0) {
+      overlay_commit =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevcommit_arg.length()) !=
+          0;
+    }
+    if (arg.find(blkdevreadahead_arg) == 0) {
+      readahead_extents =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevreadahead_arg.length());
+    }
+    if (arg.find(blkdevmaxreqlen_arg) == 0) {
+      max_req_len =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevmaxreqlen_arg.length());
+    }
+    if (arg.find(blkdevstats_arg) == 0) {
+      stats_name = const_cast<char *>(arg.c_str()) + blkdevstats_arg.length();
+    }
+    if (arg.find(blkdevstatsinterval_arg) == 0) {
+      stats_interval = atof(const_cast<char *>(arg.c_str()) +
+                            blkdevstatsinterval_arg.length());
+    }
+    // Coalesces writes in memory instead of writing each one out
+    if (arg.find(blkdevwriteback_arg) == 0) {
+      writeback_mib =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevwriteback_arg.length());
+    }
+    if (arg.find(blkdevwbinterval_arg) == 0) {
+      writeback_interval = atof(const_cast<char *>(arg.c_str()) +
+                                blkdevwbinterval_arg.length());
+    }
   }
 
   uint32_t max_latency = (1UL << latency_bits) - 1;
@@ -99,6 +183,20 @@ blockdev_t::blockdev_t(simif_t &sim,
     abort();
   }
 
+  // the widget counts the beats of a request in a sector-address-sized
+  // register
+  if (max_req_len == 0 ||
+      (uint64_t)max_req_len * SECTOR_BEATS >= (1ULL << 32) - 1) {
+    fprintf(stderr,
+            "Requested blockdev max request length (%u) is not supported.\n",
+            max_req_len);
+    abort();
+  }
+
+  if (stats_name) {
+    stats = new blkdev_stats_t(stats_name, blkdevno, _ntags, stats_interval);
+  }
+
   if (logname) {
     logfile = fopen(logname, "w");
     if (logfile == nullptr) {
@@ -107,7 +205,39 @@ blockdev_t::blockdev_t(simif_t &sim,
     }
   }
 
-  if (filename) {
+  if (overlay_name && !filename) {
+    fprintf(stderr, "+blkdev-overlay%d needs an image\n", blkdevno);
+    abort();
+  }
+
+  // an overlaid image is shared between runs, it is only opened for writing
+  // if the delta is to be committed
+  bool read_only = overlay_name && !overlay_commit;
+  // set if the disk is accessed from threads other than the simulation's
+  bool threaded = io_threads || readahead_extents;
+
+  if (filename && (use_mmap || threaded || overlay_name)) {
+    // stdio is not thread safe, worker threads use pread/pwrite or the
+    // mapping
+    disk_fd = open(filename, read_only ? O_RDONLY : O_RDWR);
+    if (disk_fd < 0) {
+      fprintf(stderr, "Could not open %s\n", filename);
+      abort();
+    }
+    struct stat st;
+    if (fstat(disk_fd, &st)) {
+      perror("fstat");
+      abort();
+    }
+    size = st.st_size;
+    if (use_mmap) {
+      // an overlaid image is never stored to through the mapping
+      map_disk(size, overlay_name ? PROT_READ : PROT_READ | PROT_WRITE);
+    }
+    if (overlay_name) {
+      overlay = new blkdev_overlay_t(overlay_name, size >> SECTOR_SHIFT);
+    }
+  } else if (filename) {
     _file = fopen(filename, "r+");
     if (!_file) {
       fprintf(stderr, "Could not open %s\n", filename);
@@ -122,6 +252,10 @@ blockdev_t::blockdev_t(simif_t &sim,
       perror("ftell");
       abort();
     }
+  } else if (mem_filesize > 0 && threaded) {
+    // an anonymous mapping can be shared with the worker threads
+    size = mem_filesize << SECTOR_SHIFT;
+    map_disk(size, PROT_READ | PROT_WRITE);
   } else if (mem_filesize > 0) {
     size = mem_filesize << SECTOR_SHIFT;
     _file = fmemopen(nullptr, size, "r+");
@@ -135,16 +269,181 @@ blockdev_t::blockdev_t(simif_t &sim,
   _nsectors = size >> SECTOR_SHIFT;
 
   write_trackers.resize(_ntags);
+  buffers = new blkdev_buffer_pool_t((size_t)max_req_len * SECTOR_BEATS);
+
+  if (io_threads) {
+    io_pool = new blkdev_io_pool_t(
+        [this](const blkdev_io_pool_t::job_t &job) {
+          if (job.write) {
+            write_disk(job.offset, job.buf, job.bytes);
+          } else {
+            read_disk(job.offset, job.buf, job.bytes);
+          }
+        },
+        io_threads);
+  }
+
+  if (readahead_extents && _nsectors) {
+    readahead = new blkdev_readahead_t(
+        [this](uint64_t sector, void *buf, uint64_t count) {
+          read_disk(sector << SECTOR_SHIFT, buf, count << SECTOR_SHIFT);
+        },
+        _nsectors,
+        max_req_len,
+        readahead_extents);
+  }
+
+  if (writeback_mib) {
+    writeback = new blkdev_writeback_t(
+        [this](uint64_t sector, const void *buf, uint64_t count) {
+          write_disk(sector << SECTOR_SHIFT, buf, count << SECTOR_SHIFT);
+          // a prefetch in flight may have read some of the old data
+          if (readahead) {
+            readahead->invalidate(sector, count);
+          }
+        },
+        (uint64_t)writeback_mib << 20,
+        writeback_interval);
+  }
 }
 
 blockdev_t::~blockdev_t() {
-  if (filename) {
+  // completes any outstanding I/O before the image goes away
+  delete writeback;
+  delete io_pool;
+  delete readahead;
+  delete overlay;
+  delete stats;
+  delete buffers;
+  if (disk) {
+    munmap(disk, disk_bytes);
+  }
+  if (disk_fd >= 0) {
+    close(disk_fd);
+  }
+  if (_file && filename) {
     fclose(_file);
   }
   if (logfile)
     fclose(logfile);
 }
 
+/* Map the whole disk image shared, so that stores from handle_data land in
+ * the file. Only whole sectors are ever accessed. */
+void blockdev_t::map_disk(long size, int prot) {
+  disk_bytes = size;
+  if (disk_bytes == 0) {
+    return;
+  }
+  int flags = disk_fd >= 0 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS;
+  void *p = mmap(nullptr, disk_bytes, prot, flags, disk_fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s\n", filename ? filename : "disk");
+    abort();
+  }
+  disk = (uint8_t *)p;
+}
+
+/* Copy bytes at offset out of the disk image, via the mapping if there is
+ * one. The caller has already checked the range. Only the stdio path is
+ * unsafe to call from the I/O worker threads. */
+void blockdev_t::read_image(uint64_t offset, void *buf, uint64_t bytes) {
+  if (disk) {
+    memcpy(buf, disk + offset, bytes);
+    return;
+  }
+  if (disk_fd >= 0) {
+    for (uint64_t done = 0; done < bytes;) {
+      ssize_t n =
+          pread(disk_fd, (uint8_t *)buf + done, bytes - done, offset + done);
+      if (n <= 0) {
+        fprintf(stderr, "Cannot read data at %" PRIx64 "\n", offset);
+        abort();
+      }
+      done += n;
+    }
+    return;
+  }
+
+  /* Seek to correct place in the file. */
+  if (fseek(_file, offset, SEEK_SET)) {
+    fprintf(stderr, "Could not seek to %" PRIx64 "\n", offset);
+    abort();
+  }
+
+  /* Perform the read from file. */
+  if (fread(buf, 1, bytes, _file) < bytes) {
+    fprintf(stderr, "Cannot read data at %" PRIx64 "\n", offset);
+    abort();
+  }
+}
+
+void blockdev_t::write_image(uint64_t offset,
+                             const void *buf,
+                             uint64_t bytes) {
+  if (disk) {
+    memcpy(disk + offset, buf, bytes);
+    return;
+  }
+  if (disk_fd >= 0) {
+    for (uint64_t done = 0; done < bytes;) {
+      ssize_t n = pwrite(
+          disk_fd, (const uint8_t *)buf + done, bytes - done, offset + done);
+      if (n <= 0) {
+        fprintf(stderr, "Cannot write data at %" PRIx64 "\n", offset);
+        abort();
+      }
+      done += n;
+    }
+    return;
+  }
+
+  /* Seek to the right place to begin the write to file. */
+  if (fseek(_file, offset, SEEK_SET)) {
+    fprintf(stderr, "Could not seek to %" PRIx64 "\n", offset);
+    abort();
+  }
+
+  /* Perform the write to file. */
+  if (fwrite(buf, 1, bytes, _file) < bytes) {
+    fprintf(stderr, "Cannot write data at %" PRIx64 "\n", offset);
+    abort();
+  }
+}
+
+/* Read from the disk as the target sees it: sectors the overlay holds come
+ * from the delta, all others from the image */
+void blockdev_t::read_disk(uint64_t offset, void *buf, uint64_t bytes) {
+  if (!overlay) {
+    read_image(offset, buf, bytes);
+    return;
+  }
+
+  uint64_t sector = offset >> SECTOR_SHIFT;
+  uint64_t remaining = bytes >> SECTOR_SHIFT;
+  uint8_t *dst = (uint8_t *)buf;
+  while (remaining) {
+    bool in_delta;
+    uint64_t count = overlay->run(sector, remaining, in_delta);
+    if (in_delta) {
+      overlay->read(sector, dst, count);
+    } else {
+      read_image(sector << SECTOR_SHIFT, dst, count << SECTOR_SHIFT);
+    }
+    sector += count;
+    remaining -= count;
+    dst += count << SECTOR_SHIFT;
+  }
+}
+
+void blockdev_t::write_disk(uint64_t offset, const void *buf, uint64_t bytes) {
+  if (overlay) {
+    overlay->write(offset >> SECTOR_SHIFT, buf, bytes >> SECTOR_SHIFT);
+  } else {
+    write_image(offset, buf, bytes);
+  }
+}
+
 /* "init" for blockdev widget that gets called right before target_reset.
  * Here, we set control regs e.g. for # sectors, allowed request length
  * at boot */
@@ -156,12 +455,11 @@ void blockdev_t::init() {
   write(mmio_addrs.write_latency, write_latency);
 }
 
-/* Take a read request, get data from the disk file, and fill the beats
- * into the response queue from which data will be written to the block device
- * widget on the FPGA */
+/* Take a read request, get data from the disk file into the tag's buffer,
+ * and queue it as a response to be streamed to the block device widget on
+ * the FPGA */
 void blockdev_t::do_read(struct blkdev_request &req) {
   uint64_t offset, nbeats;
-  uint64_t blk_data[MAX_REQ_LEN * SECTOR_BEATS];
 
   offset = req.offset;
   offset <<= SECTOR_SHIFT;
@@ -180,11 +478,11 @@ void blockdev_t::do_read(struct blkdev_request &req) {
     fprintf(stderr, "Read request cannot have 0 length\n");
     abort();
   }
-  if (req.len > MAX_REQ_LEN) {
+  if (req.len > max_req_len) {
     fprintf(stderr,
             "Read request length too large: %u > %u\n",
             req.len,
-            MAX_REQ_LEN);
+            max_req_len);
     abort();
   }
   if (req.tag >= _ntags) {
@@ -192,30 +490,73 @@ void blockdev_t::do_read(struct blkdev_request &req) {
     abort();
   }
 
-  /* Seek to correct place in the file. */
-  if (fseek(_file, offset, SEEK_SET)) {
-    fprintf(stderr, "Could not seek to %" PRIx64 "\n", offset);
-    abort();
+  uint64_t *blk_data = buffers->acquire();
+
+  /* Serve sequential reads from what has been read ahead */
+  if (readahead && readahead->read(req.offset, req.len, blk_data)) {
+    if (writeback) {
+      writeback->patch(req.offset, req.len, blk_data);
+    }
+    queue_read_data(req.tag, offset, nbeats, blk_data);
+    return;
   }
 
-  /* Perform the read from file. */
-  if (fread(blk_data, SECTOR_SIZE, req.len, _file) < req.len) {
-    fprintf(stderr, "Cannot read data at %" PRIx64 "\n", offset);
-    abort();
+  /* Reads of buffered writes are patched right away, as a flush may change
+   * the disk under an asynchronous read */
+  bool buffered = writeback && writeback->overlaps(req.offset, req.len);
+
+  /* Hand the read to a worker, its data is queued once it is reaped */
+  if (io_pool && !buffered) {
+    io_pool->submit({false,
+                     req.tag,
+                     offset,
+                     nbeats * sizeof(uint64_t),
+                     blk_data});
+    return;
+  }
+
+  /* A mapped image is streamed straight from the mapping */
+  if (disk && !overlay && !buffered) {
+    buffers->release(blk_data);
+    push_read_data(
+        req.tag, (const uint64_t *)(disk + offset), nbeats, nullptr);
+    return;
+  }
+  read_disk(offset, blk_data, nbeats * sizeof(uint64_t));
+  if (buffered) {
+    writeback->patch(req.offset, req.len, blk_data);
+  }
+  queue_read_data(req.tag, offset, nbeats, blk_data);
+}
+
+/* Queue a read served on the simulation thread. With worker threads, it
+ * still goes through the pool, so that responses leave in request order. */
+void blockdev_t::queue_read_data(uint32_t tag,
+                                 uint64_t offset,
+                                 uint64_t nbeats,
+                                 uint64_t *buf) {
+  if (io_pool) {
+    io_pool->submit_done({false, tag, offset, nbeats * sizeof(uint64_t), buf});
+    return;
   }
+  push_read_data(tag, buf, nbeats, buf);
+}
 
-  /* Populate response queue from data that has been read from file. Response
-   * queue will be consumed when writing to FPGA. */
-  for (uint64_t i = 0; i < nbeats; i++) {
-    struct blkdev_data resp;
-    resp.data = blk_data[i];
-    resp.tag = req.tag;
-    read_responses.push(resp);
+/* Queue data that has been read from file as a response. Response queue
+ * will be consumed when writing to FPGA, and buf, if any, is then returned
+ * to the pool. */
+void blockdev_t::push_read_data(uint32_t tag,
+                                const uint64_t *data,
+                                uint64_t nbeats,
+                                uint64_t *buf) {
+  read_responses.push_back({tag, data, nbeats, 0, buf});
+  if (stats) {
+    stats->complete(tag);
   }
 }
 
 /* Take a write request and set up a write_tracker to process it.
- * Later, handle_data will be called to actually perform the writes
+ * Later, accept_data will be called to actually perform the writes
  * to file. */
 void blockdev_t::do_write(struct blkdev_request &req) {
   if (req.tag >= _ntags) {
@@ -239,12 +580,13 @@ void blockdev_t::do_write(struct blkdev_request &req) {
     fprintf(stderr, "Write request cannot have 0 length\n");
     abort();
   }
-  if (req.len > MAX_REQ_LEN) {
-    fprintf(stderr, "Write request too large: %u > %u\n", req.len, MAX_REQ_LEN);
+  if (req.len > max_req_len) {
+    fprintf(stderr, "Write request too large: %u > %u\n", req.len, max_req_len);
     abort();
   }
 
   /* Setup tracker state */
+  tracker.data = buffers->acquire();
   tracker.offset = req.offset;
   tracker.offset *= SECTOR_SIZE;
   tracker.count = 0;
@@ -252,56 +594,104 @@ void blockdev_t::do_write(struct blkdev_request &req) {
   tracker.size *= SECTOR_BEATS;
 }
 
-/* Confirm that a write_tracker has been setup for a chunk of data that
- * we have received from the block device widget, to be written to file */
-bool blockdev_t::can_accept(struct blkdev_data &data) {
-  return write_trackers[data.tag].size > 0;
-}
-
-void blockdev_t::handle_data(struct blkdev_data &data) {
-  if (data.tag >= _ntags) {
-    /* Check that data.tag is in range.
+/* Copy a run of write data beats into the write_tracker for their tag,
+ * provided one has been set up, and write the data to file once the
+ * tracker is full */
+bool blockdev_t::accept_data(uint32_t tag,
+                             const uint64_t *beats,
+                             uint64_t nbeats) {
+  if (tag >= _ntags) {
+    /* Check that tag is in range.
      * This check must happen before we index into write_trackers */
-    fprintf(stderr, "Data tag %d too large.\n", data.tag);
+    fprintf(stderr, "Data tag %d too large.\n", tag);
     abort();
   }
 
-  struct blkdev_write_tracker &tracker = write_trackers[data.tag];
+  struct blkdev_write_tracker &tracker = write_trackers[tag];
+  if (tracker.size == 0) {
+    return false;
+  }
+  if (tracker.count + nbeats > tracker.size) {
+    fprintf(stderr, "Write data for tag %d overruns its request.\n", tag);
+    abort();
+  }
 
   /* Copy data into the write tracker */
-  tracker.data[tracker.count] = data.data;
-  tracker.count++;
+  memcpy(tracker.data + tracker.count, beats, nbeats * sizeof(uint64_t));
+  tracker.count += nbeats;
 
   if (tracker.count < tracker.size) {
     /* We are still waiting to receive all the data for this write
      * request, so return. */
-    return;
+    return true;
   }
 
-  /* Seek to the right place to begin the write to file. */
-  if (fseek(_file, tracker.offset, SEEK_SET)) {
-    fprintf(stderr, "Could not seek to %" PRIx64 "\n", tracker.offset);
-    abort();
+  /* A buffered write is acked as soon as it has been copied */
+  if (writeback) {
+    writeback->write(tracker.offset >> SECTOR_SHIFT,
+                     tracker.data,
+                     tracker.size / SECTOR_BEATS);
+    complete_write(tag);
+    return true;
   }
 
-  /* Perform the write to file. */
-  if (fwrite(tracker.data, sizeof(uint64_t), tracker.count, _file) <
-      tracker.count) {
-    fprintf(stderr, "Cannot write data at %" PRIx64 "\n", tracker.offset);
-    abort();
+  /* The tracker stays busy until a worker has written its data out. The tag
+   * cannot be reused before it is acked. */
+  if (io_pool) {
+    io_pool->submit({true,
+                     tag,
+                     tracker.offset,
+                     tracker.count * sizeof(uint64_t),
+                     tracker.data});
+    return true;
+  }
+
+  write_disk(tracker.offset, tracker.data, tracker.count * sizeof(uint64_t));
+  complete_write(tag);
+  return true;
+}
+
+void blockdev_t::complete_write(uint32_t tag) {
+  struct blkdev_write_tracker &tracker = write_trackers[tag];
+
+  /* The data is written or buffered, anything read ahead of it is stale */
+  if (readahead) {
+    readahead->invalidate(tracker.offset >> SECTOR_SHIFT,
+                          tracker.size / SECTOR_BEATS);
   }
 
   /* Clear the tracker state */
+  buffers->release(tracker.data);
+  tracker.data = nullptr;
   tracker.offset = 0;
   tracker.count = 0;
   tracker.size = 0;
 
   /* Send an ack to the block device.
    * TODO: should a block device do this?  Biancolin: Yes.*/
-  write_acks.push(data.tag);
+  write_acks.push(tag);
+  if (stats) {
+    stats->complete(tag);
+  }
+}
+
+/* Queue the responses of all asynchronous I/O that has completed */
+void blockdev_t::reap_io() {
+  completed_io.clear();
+  io_pool->reap(completed_io);
+  for (auto &job : completed_io) {
+    if (job.write) {
+      complete_write(job.tag);
+    } else {
+      push_read_data(job.tag,
+                     (const uint64_t *)job.buf,
+                     job.bytes / sizeof(uint64_t),
+                     (uint64_t *)job.buf);
+    }
+  }
 }
 
-/* Read all pending request data from the widget */
+/* Read all pending requests from the widget */
 void blockdev_t::recv() {
   /* Read all pending requests from the widget */
   while (read(mmio_addrs.bdev_req_valid)) {
@@ -313,24 +703,53 @@ void blockdev_t::recv() {
     req.tag = read(mmio_addrs.bdev_req_tag);
     write(mmio_addrs.bdev_req_ready, true);
     requests.push(req);
+    if (stats) {
+      stats->request(req.write, req.len, req.tag);
+    }
     blkdev_printf("[disk] got req. write %x, offset %x, len %x, tag %x\n",
                   req.write,
                   req.offset,
                   req.len,
                   req.tag);
   }
+}
 
-  /* Read all pending data beats from the widget */
-  while (read(mmio_addrs.bdev_data_valid)) {
-    /* Take a data chunk from the FPGA and put it in SW processing queues */
-    struct blkdev_data data;
-    data.data = (((uint64_t)read(mmio_addrs.bdev_data_data_upper)) << 32) |
-                (read(mmio_addrs.bdev_data_data_lower) & 0xFFFFFFFF);
-    data.tag = read(mmio_addrs.bdev_data_tag);
-    write(mmio_addrs.bdev_data_ready, true);
-    req_data.push(data);
-    blkdev_printf("[disk] got data. data %llx, tag %x\n", data.data, data.tag);
+/* Pull all write data the widget has streamed out so far into the write
+ * trackers. Each word carries up to STREAM_WORD_BEATS beats of a single
+ * tag. Words are taken strictly in order: data for a request that has not
+ * been taken yet waits in early_data, along with every word behind it, so
+ * that writes complete in the order the target sent their data. */
+void blockdev_t::recv_data() {
+  const size_t word_u64s = STREAM_WIDTH_BYTES / sizeof(uint64_t);
+
+  /* Words held back on an earlier tick go first */
+  size_t taken = 0;
+  while (taken < early_data.size()) {
+    uint32_t nbeats = early_data[taken] & 0xFFFFFFFF;
+    uint32_t tag = early_data[taken] >> 32;
+    if (!accept_data(tag, &early_data[taken + 1], nbeats)) {
+      break;
+    }
+    taken += word_u64s;
   }
+  early_data.erase(early_data.begin(), early_data.begin() + taken);
+
+  const size_t max_bytes = stream_to_cpu_depth * STREAM_WIDTH_BYTES;
+  page_aligned_sized_array(inbuf, max_bytes);
+  size_t bytes = pull(stream_to_cpu_idx, inbuf, max_bytes, 0);
+  const uint64_t *words = (const uint64_t *)inbuf;
+  const size_t num_u64s = bytes / sizeof(uint64_t);
+  size_t i = 0;
+  while (early_data.empty() && i < num_u64s) {
+    uint32_t nbeats = words[i] & 0xFFFFFFFF;
+    uint32_t tag = words[i] >> 32;
+    blkdev_printf("[disk] got data. %u beats, tag %x\n", nbeats, tag);
+    if (!accept_data(tag, &words[i + 1], nbeats)) {
+      break;
+    }
+    i += word_u64s;
+  }
+  early_data.insert(early_data.end(), words + i, words + num_u64s);
 }
 
 /* This dumps as much read_response and write_ack data onto the widget as
@@ -346,40 +765,105 @@ void blockdev_t::send() {
     write_acks.pop();
   }
 
-  /* Send as much read reponse data as as the blockdev widget will accept */
-  while (!read_responses.empty() && read(mmio_addrs.bdev_rresp_ready)) {
-    struct blkdev_data resp;
-    resp = read_responses.front();
-    write(mmio_addrs.bdev_rresp_data_upper, (resp.data >> 32) & 0xFFFFFFFF);
-    write(mmio_addrs.bdev_rresp_data_lower, resp.data & 0xFFFFFFFF);
-    write(mmio_addrs.bdev_rresp_tag, resp.tag);
-    write(mmio_addrs.bdev_rresp_valid, true);
-    blkdev_printf(
-        "[disk] sending R resp. data %llx, tag %x\n", resp.data, resp.tag);
-    read_responses.pop();
+  /* Pack read reponse data into stream words, each response continuing
+   * from its cursor, and push as many as the stream will accept */
+  if (!read_responses.empty()) {
+    const size_t max_words = stream_from_cpu_depth;
+    page_aligned_sized_array(outbuf, max_words * STREAM_WIDTH_BYTES);
+    uint64_t *words = (uint64_t *)outbuf;
+    const size_t word_u64s = STREAM_WIDTH_BYTES / sizeof(uint64_t);
+    size_t nwords = 0;
+    for (auto &resp : read_responses) {
+      for (uint64_t b = resp.sent; b < resp.nbeats && nwords < max_words;
+           b += STREAM_WORD_BEATS) {
+        uint64_t n = std::min<uint64_t>(STREAM_WORD_BEATS, resp.nbeats - b);
+        uint64_t *word = words + nwords * word_u64s;
+        word[0] = ((uint64_t)resp.tag << 32) | n;
+        memcpy(word + 1, resp.data + b, n * sizeof(uint64_t));
+        nwords++;
+      }
+      if (nwords == max_words) {
+        break;
+      }
+    }
+
+    size_t sent =
+        push(stream_from_cpu_idx, outbuf, nwords * STREAM_WIDTH_BYTES, 0);
+
+    /* Advance the cursors past what the stream took */
+    size_t sent_words = sent / STREAM_WIDTH_BYTES;
+    while (sent_words) {
+      struct blkdev_read_response &resp = read_responses.front();
+      uint64_t left = (resp.nbeats - resp.sent + STREAM_WORD_BEATS - 1) /
+                      STREAM_WORD_BEATS;
+      uint64_t taken = std::min<uint64_t>(left, sent_words);
+      resp.sent = std::min(resp.nbeats, resp.sent + taken * STREAM_WORD_BEATS);
+      sent_words -= taken;
+      blkdev_printf("[disk] sending R resp. %" PRIu64 " beats, tag %x\n",
+                    resp.sent,
+                    resp.tag);
+      if (resp.sent == resp.nbeats) {
+        if (resp.buf) {
+          buffers->release(resp.buf);
+        }
+        read_responses.pop_front();
+      }
+    }
   }
 
   /* Mark if finished */
   resp_data_pending = !read_responses.empty() || !write_acks.empty();
 }
 
+/* The widget does not report data sitting in the to-CPU stream, but it only
+ * sends data for write requests we have already taken. */
+bool blockdev_t::receiving_write_data() {
+  if (!early_data.empty()) {
+    return true;
+  }
+  for (auto &tracker : write_trackers) {
+    if (tracker.count < tracker.size) {
+      return true;
+    }
+  }
+  return false;
+}
+
 bool blockdev_t::idle() {
-  return !resp_data_pending && !read(mmio_addrs.bdev_reqs_pending);
+  return !resp_data_pending && !(io_pool && io_pool->in_flight()) &&
+         !receiving_write_data() && !read(mmio_addrs.bdev_reqs_pending);
 }
 
 /* This method is called to service functional requests made by the widget.
  * No target time is modelled here; the widget will stall stimulation if
  * we have not yet serviced a transaction that is scheduled to be released. */
 void blockdev_t::tick() {
+  if (stats) {
+    stats->tick();
+  }
+  if (writeback) {
+    writeback->tick();
+  }
 
   /* If there's nothing to do, early out and save a bunch of MMIO */
   if (idle()) {
     return;
   }
 
+  /* The widget can only be stalled waiting on us if we are not idle */
+  if (stats) {
+    stats->sample_stalls(read(mmio_addrs.bdev_rresp_stalled),
+                         read(mmio_addrs.bdev_wack_stalled));
+  }
+
+  /* Pick up the I/O the workers have finished since the last tick */
+  if (io_pool) {
+    reap_io();
+  }
+
   /* If there's pending response data from the last invocation of tick(),
    * write that back first as it might be locking up the simulator */
-  if (resp_data_pending) {
+  if (resp_data_pending || !read_responses.empty() || !write_acks.empty()) {
     this->send();
   }
 
@@ -401,17 +885,47 @@ void blockdev_t::tick() {
     requests.pop();
   }
 
-  /* Do software processing of write data queues. (data coming from the
-   * block dev widget).
-   *
-   * If there is data in req_data (from the FPGA) and a tracker has been
-   * properly setup for this write, then call handle_data for this beat
-   * of the write. */
-  while (!req_data.empty() && can_accept(req_data.front())) {
-    handle_data(req_data.front());
-    req_data.pop();
-  }
+  /* Do software processing of write data. (data streamed from the block
+   * dev widget). Now that their trackers are set up, each run of beats is
+   * copied into the tracker for its tag. */
+  this->recv_data();
 
   /* Write state back to block device widget */
   this->send();
 }
+
+/* Make sure everything the target wrote has reached the image: outstanding
+ * I/O is completed and buffered writes written out, then the mapping,
+ * descriptor or stdio buffer is synced back to disk. */
+void blockdev_t::finish() {
+  if (io_pool) {
+    io_pool->drain();
+  }
+  if (writeback) {
+    writeback->flush();
+    writeback->report(stdout, blkdevno);
+  }
+  if (readahead) {
+    readahead->report(stdout, blkdevno);
+  }
+  if (stats) {
+    stats->report();
+  }
+  if (overlay) {
+    printf("blockdev: %s %" PRIu64 " sectors from overlay\n",
+           overlay_commit ? "committing" : "discarding",
+           overlay->sectors_in_delta());
+    if (overlay_commit) {
+      overlay->commit(disk_fd);
+    }
+  }
+  if (disk_fd >= 0 && (!disk || overlay_commit) && fsync(disk_fd)) {
+    perror("fsync");
+  }
+  if (disk && disk_fd >= 0 && msync(disk, disk_bytes, MS_SYNC)) {
+    perror("msync");
+  }
+  if (_file) {
+    fflush(_file);
+  }
+}
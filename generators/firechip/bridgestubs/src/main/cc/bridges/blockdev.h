@@ -2,11 +2,18 @@
 #ifndef __BLOCKDEV_H
 #define __BLOCKDEV_H
 
+#include <deque>
 #include <queue>
 #include <stdio.h>
 #include <vector>
 
+#include "bridges/blockdev_io.h"
+#include "bridges/blockdev_overlay.h"
+#include "bridges/blockdev_readahead.h"
+#include "bridges/blockdev_stats.h"
+#include "bridges/blockdev_writeback.h"
 #include "core/bridge_driver.h"
+#include "core/stream_engine.h"
 
 struct BLOCKDEVBRIDGEMODULE_struct {
   uint64_t read_latency;
@@ -19,16 +26,6 @@ struct BLOCKDEVBRIDGEMODULE_struct {
   uint64_t bdev_req_len;
   uint64_t bdev_req_tag;
   uint64_t bdev_req_ready;
-  uint64_t bdev_data_valid;
-  uint64_t bdev_data_data_upper;
-  uint64_t bdev_data_data_lower;
-  uint64_t bdev_data_tag;
-  uint64_t bdev_data_ready;
-  uint64_t bdev_rresp_data_upper;
-  uint64_t bdev_rresp_data_lower;
-  uint64_t bdev_rresp_tag;
-  uint64_t bdev_rresp_valid;
-  uint64_t bdev_rresp_ready;
   uint64_t bdev_wack_tag;
   uint64_t bdev_wack_valid;
   uint64_t bdev_wack_ready;
@@ -40,8 +37,15 @@ struct BLOCKDEVBRIDGEMODULE_struct {
 #define SECTOR_SIZE 512
 #define SECTOR_SHIFT 9
 #define SECTOR_BEATS (SECTOR_SIZE / 8)
+// Default for +blkdev-max-req-lenN, the longest request in sectors the
+// widget is told to issue
 #define MAX_REQ_LEN 16
 
+// Write data and read responses are streamed in words of a header,
+// {tag[63:32], nbeats[31:0]}, followed by up to STREAM_WORD_BEATS beats of
+// that tag. Requests and write acks remain on MMIO.
+#define STREAM_WORD_BEATS 7
+
 struct blkdev_request {
   bool write;
   uint32_t offset;
@@ -49,42 +53,60 @@ struct blkdev_request {
   uint32_t tag;
 };
 
-struct blkdev_data {
-  uint64_t data;
+// Read data for one request, streamed out from a cursor
+struct blkdev_read_response {
   uint32_t tag;
+  const uint64_t *data;
+  uint64_t nbeats;
+  uint64_t sent;
+  // pool buffer holding data, released once sent; null for the mapping
+  uint64_t *buf;
 };
 
 struct blkdev_write_tracker {
   uint64_t offset;
   uint64_t count;
   uint64_t size;
-  uint64_t data[MAX_REQ_LEN * SECTOR_BEATS];
+  // pool buffer, only held while a write is in progress
+  uint64_t *data;
 };
 
-class blockdev_t : public bridge_driver_t {
+class blockdev_t : public streaming_bridge_driver_t {
 public:
   /// The identifier for the bridge type used for casts.
   static char KIND;
 
   blockdev_t(simif_t &sim,
+             StreamEngine &stream,
              const BLOCKDEVBRIDGEMODULE_struct &mmio_addrs,
              int blkdevno,
              const std::vector<std::string> &args,
              uint32_t num_trackers,
-             uint32_t latency_bits);
+             uint32_t latency_bits,
+             int stream_to_cpu_idx,
+             int stream_to_cpu_depth,
+             int stream_from_cpu_idx,
+             int stream_from_cpu_depth);
   ~blockdev_t() override;
 
   uint32_t nsectors(void) { return _nsectors; }
-  uint32_t max_request_length(void) { return MAX_REQ_LEN; }
+  uint32_t max_request_length(void) { return max_req_len; }
 
   void init() override;
   void tick() override;
+  void finish() override;
 
   void send();
   void recv();
+  void recv_data();
 
 private:
   const BLOCKDEVBRIDGEMODULE_struct mmio_addrs;
+  const int blkdevno;
+  const int stream_to_cpu_idx;
+  const int stream_to_cpu_depth;
+  const int stream_from_cpu_idx;
+  const int stream_from_cpu_depth;
 
   // Set if, on the previous tick, we couldn't write back all of our response
   // data
@@ -92,19 +114,66 @@ private:
 
   uint32_t _ntags;
   uint32_t _nsectors;
+  // Set with +blkdev-max-req-lenN=<sectors>, and passed on to the widget
+  uint32_t max_req_len = MAX_REQ_LEN;
   FILE *_file, *logfile;
   char *filename = nullptr;
+  // Set with +blkdev-mmapN=1: the image is mapped at disk and accessed with
+  // plain copies instead of stdio
+  int disk_fd = -1;
+  uint8_t *disk = nullptr;
+  size_t disk_bytes = 0;
+  // Set with +blkdev-io-threadsN=<n>: requests are serviced on n worker
+  // threads and their responses returned on a later tick
+  blkdev_io_pool_t *io_pool = nullptr;
+  // max_req_len sized buffers for write trackers and read data
+  blkdev_buffer_pool_t *buffers = nullptr;
+  std::vector<blkdev_io_pool_t::job_t> completed_io;
+  // Set with +blkdev-overlayN=<delta>: the image is only read, writes go to
+  // the delta, which is dropped at exit or, with +blkdev-overlay-commitN=1,
+  // copied into the image by finish()
+  blkdev_overlay_t *overlay = nullptr;
+  bool overlay_commit = false;
+  // Set with +blkdev-readaheadN=<extents>: sequential reads are prefetched
+  // that many max_req_len extents ahead
+  blkdev_readahead_t *readahead = nullptr;
+  // Set with +blkdev-statsN=<file>, reported every
+  // +blkdev-stats-intervalN=<seconds> (default 10) and at exit
+  blkdev_stats_t *stats = nullptr;
+  // Set with +blkdev-writebackN=<MiB>: completed writes are buffered and
+  // coalesced, and written out when the buffer is full, every
+  // +blkdev-writeback-intervalN=<seconds> (default 1) and by finish()
+  blkdev_writeback_t *writeback = nullptr;
   std::queue<blkdev_request> requests;
-  std::queue<blkdev_data> req_data;
-  std::queue<blkdev_data> read_responses;
+  // stream words of write data that arrived before their request was taken
+  std::vector<uint64_t> early_data;
+  std::deque<blkdev_read_response> read_responses;
   std::queue<uint32_t> write_acks;
 
   std::vector<blkdev_write_tracker> write_trackers;
 
+  void map_disk(long size, int prot);
+  void read_image(uint64_t offset, void *buf, uint64_t bytes);
+  void write_image(uint64_t offset, const void *buf, uint64_t bytes);
+  void read_disk(uint64_t offset, void *buf, uint64_t bytes);
+  void write_disk(uint64_t offset, const void *buf, uint64_t bytes);
+  void push_read_data(uint32_t tag,
+                      const uint64_t *data,
+                      uint64_t nbeats,
+                      uint64_t *buf);
+  void queue_read_data(uint32_t tag,
+                       uint64_t offset,
+                       uint64_t nbeats,
+                       uint64_t *buf);
+  // true if the write data was taken, false if no tracker is set up for tag
+  bool accept_data(uint32_t tag, const uint64_t *beats, uint64_t nbeats);
+  void complete_write(uint32_t tag);
+  void reap_io();
+
   void do_read(struct blkdev_request &req);
   void do_write(struct blkdev_request &req);
-  bool can_accept(struct blkdev_data &data);
-  void handle_data(struct blkdev_data &data);
+  // True while write data is expected on the to-CPU stream
+  bool receiving_write_data();
   // Returns true if no widget interaction is required
   bool idle();
 
@@ -0,0 +1,98 @@
+// See LICENSE for license details
+
+#include "blockdev_io.h"
+
+blkdev_io_pool_t::blkdev_io_pool_t(handler_t handler, unsigned num_threads)
+    : handler(std::move(handler)) {
+  for (unsigned i = 0; i < num_threads; i++) {
+    workers.emplace_back(&blkdev_io_pool_t::work, this);
+  }
+}
+
+blkdev_io_pool_t::~blkdev_io_pool_t() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    terminate = true;
+  }
+  work_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void blkdev_io_pool_t::submit(const job_t &job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.emplace_back(next_submit++, job);
+  }
+  outstanding++;
+  work_cv.notify_one();
+}
+
+void blkdev_io_pool_t::submit_done(const job_t &job) {
+  std::lock_guard<std::mutex> lock(mutex);
+  completed.emplace(next_submit++, job);
+  outstanding++;
+}
+
+void blkdev_io_pool_t::reap(std::vector<job_t> &done) {
+  std::lock_guard<std::mutex> lock(mutex);
+  // a finished job waits for every job submitted before it
+  auto it = completed.begin();
+  for (; it != completed.end() && it->first == next_reap; ++it) {
+    done.push_back(it->second);
+    next_reap++;
+    outstanding--;
+  }
+  completed.erase(completed.begin(), it);
+}
+
+void blkdev_io_pool_t::drain() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle_cv.wait(lock, [this] { return pending.empty() && running == 0; });
+}
+
+void blkdev_io_pool_t::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    // workers only exit once every queued job is done
+    work_cv.wait(lock, [this] { return terminate || !pending.empty(); });
+    if (pending.empty()) {
+      return;
+    }
+    std::pair<uint64_t, job_t> job = pending.front();
+    pending.pop_front();
+    running++;
+
+    lock.unlock();
+    handler(job.second);
+    lock.lock();
+
+    running--;
+    completed.emplace(job.first, job.second);
+    if (pending.empty() && running == 0) {
+      idle_cv.notify_all();
+    }
+  }
+}
+
+// buffers allocated at once when the free list runs dry
+#define BUFFERS_PER_SLAB 8
+
+blkdev_buffer_pool_t::blkdev_buffer_pool_t(size_t buffer_words)
+    : words(buffer_words) {}
+
+uint64_t *blkdev_buffer_pool_t::acquire() {
+  if (free_list.empty()) {
+    slabs.emplace_back(new uint64_t[words * BUFFERS_PER_SLAB]);
+    for (size_t i = 0; i < BUFFERS_PER_SLAB; i++) {
+      free_list.push_back(slabs.back().get() + i * words);
+    }
+    allocated += BUFFERS_PER_SLAB;
+  }
+  uint64_t *buf = free_list.back();
+  free_list.pop_back();
+  return buf;
+}
+
+void blkdev_buffer_pool_t::release(uint64_t *buf) { free_list.push_back(buf); }
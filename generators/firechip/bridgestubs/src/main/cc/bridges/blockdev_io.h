@@ -0,0 +1,100 @@
+// See LICENSE for license details
+#ifndef __BLOCKDEV_IO_H
+#define __BLOCKDEV_IO_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Worker threads that perform block device I/O off the simulation thread.
+ *
+ * The bridge submit()s one job per request and, on a later tick, reap()s the
+ * jobs that have finished. Workers may finish jobs in any order, but reap()
+ * only returns them in submission order: the widget consumes responses in
+ * order against its timing model, so what the target sees must not depend
+ * on host thread scheduling.
+ */
+class blkdev_io_pool_t {
+public:
+  struct job_t {
+    bool write;
+    uint32_t tag;
+    // byte offset into the disk image
+    uint64_t offset;
+    uint64_t bytes;
+    // owned by the bridge, untouched until the job is reaped
+    void *buf;
+  };
+
+  // Performs a single job, called concurrently from the worker threads
+  using handler_t = std::function<void(const job_t &)>;
+
+  blkdev_io_pool_t(handler_t handler, unsigned num_threads);
+  // Finishes all submitted jobs before returning
+  ~blkdev_io_pool_t();
+
+  void submit(const job_t &job);
+  // Queues a job the caller has already performed, so that it is reaped in
+  // order with the jobs submitted before it
+  void submit_done(const job_t &job);
+  // Appends the jobs completed since the last call to done, stopping at the
+  // oldest job still running. Never blocks.
+  void reap(std::vector<job_t> &done);
+  // Blocks until every submitted job has completed
+  void drain();
+
+  // Jobs submitted but not yet reaped
+  size_t in_flight() const { return outstanding; }
+
+private:
+  void work();
+
+  handler_t handler;
+  // jobs are numbered in submission order
+  std::deque<std::pair<uint64_t, job_t>> pending;
+  std::map<uint64_t, job_t> completed;
+  uint64_t next_submit = 0;
+  uint64_t next_reap = 0;
+  size_t outstanding = 0;
+  size_t running = 0;
+
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::condition_variable idle_cv;
+  bool terminate = false;
+
+  std::vector<std::thread> workers;
+};
+
+/**
+ * Request-sized data buffers, handed out from a free list and allocated in
+ * slabs as needed, so that memory grows with the requests actually in
+ * flight rather than with the number of tags times the maximum request
+ * length. Only used from the simulation thread.
+ */
+class blkdev_buffer_pool_t {
+public:
+  explicit blkdev_buffer_pool_t(size_t buffer_words);
+
+  uint64_t *acquire();
+  void release(uint64_t *buf);
+
+  size_t buffer_words() const { return words; }
+  size_t buffers_allocated() const { return allocated; }
+
+private:
+  size_t words;
+  size_t allocated = 0;
+  std::vector<std::unique_ptr<uint64_t[]>> slabs;
+  std::vector<uint64_t *> free_list;
+};
+
+#endif // __BLOCKDEV_IO_H
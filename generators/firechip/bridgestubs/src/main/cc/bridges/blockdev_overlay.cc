@@ -0,0 +1,115 @@
+// See LICENSE for license details
+
+#include "blockdev_overlay.h"
+#include "blockdev.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+blkdev_overlay_t::blkdev_overlay_t(const std::string &delta_path,
+                                   uint64_t nsectors)
+    : delta_path(delta_path), nsectors(nsectors),
+      bitmap(new std::atomic<uint64_t>[(nsectors + 63) / 64]()) {
+  this->fd = open(delta_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (this->fd < 0) {
+    fprintf(stderr, "Could not open overlay: %s\n", delta_path.c_str());
+    abort();
+  }
+  // sparse, only the sectors the target writes take up space
+  if (ftruncate(this->fd, nsectors << SECTOR_SHIFT) != 0) {
+    perror("ftruncate");
+    abort();
+  }
+}
+
+blkdev_overlay_t::~blkdev_overlay_t() {
+  close(this->fd);
+  unlink(delta_path.c_str());
+}
+
+bool blkdev_overlay_t::test(uint64_t sector) const {
+  return (bitmap[sector / 64].load(std::memory_order_relaxed) >>
+          (sector % 64)) &
+         1;
+}
+
+uint64_t
+blkdev_overlay_t::run(uint64_t sector, uint64_t max, bool &in_delta) const {
+  in_delta = test(sector);
+  uint64_t n = 1;
+  while (n < max && test(sector + n) == in_delta) {
+    n++;
+  }
+  return n;
+}
+
+void blkdev_overlay_t::read(uint64_t sector, void *buf, uint64_t count) {
+  uint64_t bytes = count << SECTOR_SHIFT;
+  uint64_t offset = sector << SECTOR_SHIFT;
+  for (uint64_t done = 0; done < bytes;) {
+    ssize_t n =
+        pread(this->fd, (uint8_t *)buf + done, bytes - done, offset + done);
+    if (n <= 0) {
+      fprintf(stderr, "Cannot read overlay at %" PRIx64 "\n", offset);
+      abort();
+    }
+    done += n;
+  }
+}
+
+void blkdev_overlay_t::write(uint64_t sector,
+                             const void *buf,
+                             uint64_t count) {
+  uint64_t bytes = count << SECTOR_SHIFT;
+  uint64_t offset = sector << SECTOR_SHIFT;
+  for (uint64_t done = 0; done < bytes;) {
+    ssize_t n = pwrite(
+        this->fd, (const uint8_t *)buf + done, bytes - done, offset + done);
+    if (n <= 0) {
+      fprintf(stderr, "Cannot write overlay at %" PRIx64 "\n", offset);
+      abort();
+    }
+    done += n;
+  }
+  // neighbouring sectors may be written concurrently by other requests
+  for (uint64_t s = sector; s < sector + count; s++) {
+    bitmap[s / 64].fetch_or(1ULL << (s % 64), std::memory_order_relaxed);
+  }
+}
+
+void blkdev_overlay_t::commit(int base_fd) {
+  std::vector<uint8_t> buf;
+  for (uint64_t sector = 0; sector < nsectors;) {
+    bool in_delta;
+    uint64_t count = run(sector, nsectors - sector, in_delta);
+    // copy in bounded pieces, a run can span the whole image
+    while (in_delta && count) {
+      uint64_t piece = count < 2048 ? count : 2048;
+      buf.resize(piece << SECTOR_SHIFT);
+      read(sector, buf.data(), piece);
+      if (pwrite(base_fd, buf.data(), buf.size(), sector << SECTOR_SHIFT) !=
+          (ssize_t)buf.size()) {
+        fprintf(stderr,
+                "Cannot commit overlay sector %" PRIu64 " to base image\n",
+                sector);
+        abort();
+      }
+      sector += piece;
+      count -= piece;
+    }
+    sector += count;
+  }
+}
+
+uint64_t blkdev_overlay_t::sectors_in_delta() const {
+  uint64_t count = 0;
+  for (uint64_t i = 0; i < (nsectors + 63) / 64; i++) {
+    count += __builtin_popcountll(bitmap[i].load(std::memory_order_relaxed));
+  }
+  return count;
+}
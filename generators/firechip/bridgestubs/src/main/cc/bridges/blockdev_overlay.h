@@ -0,0 +1,46 @@
+// See LICENSE for license details
+#ifndef __BLOCKDEV_OVERLAY_H
+#define __BLOCKDEV_OVERLAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * Copy-on-write delta over a read-only base disk image.
+ *
+ * Sectors written by the target go to a sparse delta file at the same
+ * offset they have in the image, and a bitmap records which sectors the
+ * delta holds. Reads of any other sector fall through to the base. At exit
+ * the delta is either discarded or committed, i.e. its sectors are copied
+ * into the base. Sector reads and writes may come from several threads,
+ * as long as concurrent requests do not overlap.
+ */
+class blkdev_overlay_t {
+public:
+  blkdev_overlay_t(const std::string &delta_path, uint64_t nsectors);
+  // Removes the delta file
+  ~blkdev_overlay_t();
+
+  // Returns the number of sectors, at most max, from sector on that are all
+  // in the delta, or all in the base, as reported by in_delta
+  uint64_t run(uint64_t sector, uint64_t max, bool &in_delta) const;
+  void read(uint64_t sector, void *buf, uint64_t nsectors);
+  void write(uint64_t sector, const void *buf, uint64_t nsectors);
+
+  // Copies every sector held in the delta to the base image
+  void commit(int base_fd);
+
+  uint64_t sectors_in_delta() const;
+
+private:
+  bool test(uint64_t sector) const;
+
+  std::string delta_path;
+  int fd;
+  uint64_t nsectors;
+  std::unique_ptr<std::atomic<uint64_t>[]> bitmap;
+};
+
+#endif // __BLOCKDEV_OVERLAY_H
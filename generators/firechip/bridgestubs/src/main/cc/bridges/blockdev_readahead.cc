@@ -0,0 +1,224 @@
+// See LICENSE for license details
+
+#include "blockdev_readahead.h"
+#include "blockdev.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+// stream entries, replaced least recently used first
+#define NUM_STREAMS 4
+// sequential reads a stream needs before it is prefetched
+#define TRAIN_THRESHOLD 1
+// prefetches in flight at once
+#define PREFETCH_THREADS 2
+
+blkdev_readahead_t::blkdev_readahead_t(reader_t reader,
+                                       uint64_t disk_sectors,
+                                       uint32_t extent_sectors,
+                                       uint32_t extents_ahead)
+    : reader(std::move(reader)), disk_sectors(disk_sectors),
+      extent_sectors(extent_sectors), extents_ahead(extents_ahead),
+      max_extents(2 * NUM_STREAMS * extents_ahead), streams(NUM_STREAMS) {
+  this->pool = new blkdev_io_pool_t(
+      [this](const blkdev_io_pool_t::job_t &job) {
+        this->reader(job.offset >> SECTOR_SHIFT,
+                     job.buf,
+                     job.bytes >> SECTOR_SHIFT);
+      },
+      PREFETCH_THREADS);
+}
+
+blkdev_readahead_t::~blkdev_readahead_t() {
+  // waits for prefetches still writing into extents
+  delete this->pool;
+}
+
+void blkdev_readahead_t::reap() {
+  std::vector<blkdev_io_pool_t::job_t> done;
+  pool->reap(done);
+  for (auto &job : done) {
+    auto it = extents.find(job.offset >> SECTOR_SHIFT);
+    if (it->second.stale) {
+      extents.erase(it);
+      continue;
+    }
+    it->second.ready = true;
+    ready_order.push_back(it->first);
+    prefetched++;
+  }
+}
+
+bool blkdev_readahead_t::cached(uint64_t sector,
+                                uint64_t count,
+                                bool &ready) const {
+  ready = true;
+  uint64_t end = sector + count;
+  while (sector < end) {
+    auto it = extents.upper_bound(sector);
+    if (it == extents.begin()) {
+      return false;
+    }
+    --it;
+    if (sector >= it->first + it->second.count) {
+      return false;
+    }
+    ready = ready && it->second.ready;
+    sector = it->first + it->second.count;
+  }
+  return true;
+}
+
+bool blkdev_readahead_t::read(uint64_t sector, uint64_t count, void *buf) {
+  reads++;
+  reap();
+
+  bool ready;
+  bool hit = cached(sector, count, ready) && ready;
+  if (hit) {
+    uint8_t *dst = (uint8_t *)buf;
+    uint64_t end = sector + count;
+    for (uint64_t s = sector; s < end;) {
+      auto it = std::prev(extents.upper_bound(s));
+      extent_t &extent = it->second;
+      uint64_t n = std::min(end, it->first + extent.count) - s;
+      memcpy(dst,
+             extent.data.data() + ((s - it->first) << SECTOR_SHIFT),
+             n << SECTOR_SHIFT);
+      if (!extent.used) {
+        extent.used = true;
+        prefetches_used++;
+      }
+      s += n;
+      dst += n << SECTOR_SHIFT;
+    }
+    hits++;
+  } else {
+    misses++;
+    // the prefetch was issued, but has not completed
+    if (cached(sector, count, ready)) {
+      late++;
+    }
+  }
+
+  train(sector, count);
+  return hit;
+}
+
+void blkdev_readahead_t::train(uint64_t sector, uint64_t count) {
+  stream_t *stream = nullptr;
+  for (auto &s : streams) {
+    if (s.next == sector) {
+      stream = &s;
+      break;
+    }
+  }
+
+  if (!stream) {
+    stream = &*std::min_element(streams.begin(),
+                                streams.end(),
+                                [](const stream_t &a, const stream_t &b) {
+                                  return a.last_use < b.last_use;
+                                });
+    stream->hits = 0;
+    stream->prefetched_to = sector + count;
+  } else {
+    stream->hits++;
+  }
+  stream->next = sector + count;
+  stream->last_use = reads;
+
+  if (stream->hits < TRAIN_THRESHOLD) {
+    return;
+  }
+
+  // keep extents_ahead extents past the end of the stream in flight
+  uint64_t limit = std::min<uint64_t>(
+      stream->next + (uint64_t)extents_ahead * extent_sectors, disk_sectors);
+  uint64_t next = std::max(stream->next, stream->prefetched_to);
+  while (next < limit) {
+    uint64_t after = prefetch(next);
+    if (after == next) {
+      break;
+    }
+    next = after;
+  }
+  stream->prefetched_to = next;
+}
+
+uint64_t blkdev_readahead_t::prefetch(uint64_t sector) {
+  // skip over what is already cached or in flight
+  auto it = extents.upper_bound(sector);
+  if (it != extents.begin()) {
+    auto prev = std::prev(it);
+    if (sector < prev->first + prev->second.count) {
+      return prev->first + prev->second.count;
+    }
+  }
+
+  uint64_t count = std::min<uint64_t>(extent_sectors, disk_sectors - sector);
+  if (it != extents.end()) {
+    count = std::min(count, it->first - sector);
+  }
+
+  if (extents.size() >= max_extents && !evict_oldest()) {
+    // everything is in flight
+    return sector;
+  }
+
+  extent_t &extent = extents[sector];
+  extent.count = count;
+  extent.data.resize(count << SECTOR_SHIFT);
+  pool->submit({false,
+                0,
+                sector << SECTOR_SHIFT,
+                count << SECTOR_SHIFT,
+                extent.data.data()});
+  return sector + count;
+}
+
+bool blkdev_readahead_t::evict_oldest() {
+  while (!ready_order.empty()) {
+    uint64_t sector = ready_order.front();
+    ready_order.pop_front();
+    auto it = extents.find(sector);
+    // invalidated or already replaced by a newer prefetch
+    if (it != extents.end() && it->second.ready) {
+      extents.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+void blkdev_readahead_t::invalidate(uint64_t sector, uint64_t count) {
+  uint64_t end = sector + count;
+  auto it = extents.upper_bound(sector);
+  if (it != extents.begin() &&
+      sector < std::prev(it)->first + std::prev(it)->second.count) {
+    --it;
+  }
+  while (it != extents.end() && it->first < end) {
+    if (it->second.ready) {
+      it = extents.erase(it);
+    } else {
+      it->second.stale = true;
+      ++it;
+    }
+  }
+}
+
+void blkdev_readahead_t::report(FILE *out, int blkdevno) {
+  reap();
+  fprintf(out,
+          "blockdev%d read-ahead: %" PRIu64 " hits, %" PRIu64
+          " misses (%" PRIu64 " while prefetching), %" PRIu64
+          " extents prefetched, %.1f%% used\n",
+          blkdevno,
+          hits,
+          misses,
+          late,
+          prefetched,
+          prefetched ? 100.0 * prefetches_used / prefetched : 0.0);
+}
@@ -0,0 +1,89 @@
+// See LICENSE for license details
+#ifndef __BLOCKDEV_READAHEAD_H
+#define __BLOCKDEV_READAHEAD_H
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "bridges/blockdev_io.h"
+
+/**
+ * Sequential read-ahead for the block device, after the stream buffer
+ * prefetchers: a few stream entries each remember where the last read of a
+ * stream ended. A read that starts there trains its entry, and once trained
+ * the next extents of the stream are read into host memory on a worker
+ * thread, so that later reads are served from memory.
+ *
+ * Everything but the disk reads runs on the simulation thread. A completed
+ * write must be passed to invalidate(), which also drops any prefetch of
+ * those sectors still in flight.
+ */
+class blkdev_readahead_t {
+public:
+  // Reads nsectors at sector from the disk, called from a worker thread
+  using reader_t = std::function<void(uint64_t, void *, uint64_t)>;
+
+  blkdev_readahead_t(reader_t reader,
+                     uint64_t disk_sectors,
+                     uint32_t extent_sectors,
+                     uint32_t extents_ahead);
+  ~blkdev_readahead_t();
+
+  // Copies the sectors into buf and returns true if they are all cached.
+  // Either way the read trains the stream entries.
+  bool read(uint64_t sector, uint64_t count, void *buf);
+  void invalidate(uint64_t sector, uint64_t count);
+
+  void report(FILE *out, int blkdevno);
+
+private:
+  struct extent_t {
+    uint64_t count;
+    std::vector<uint8_t> data;
+    bool ready = false;
+    // written while the prefetch was in flight, dropped once it completes
+    bool stale = false;
+    bool used = false;
+  };
+  struct stream_t {
+    uint64_t next = UINT64_MAX;
+    uint64_t prefetched_to = 0;
+    uint32_t hits = 0;
+    uint64_t last_use = 0;
+  };
+
+  void reap();
+  // True if every sector is in an extent, ready if all of those completed
+  bool cached(uint64_t sector, uint64_t count, bool &ready) const;
+  void train(uint64_t sector, uint64_t count);
+  // Starts reading the extent at sector, returns the sector after it, or
+  // sector if no extent could be allocated
+  uint64_t prefetch(uint64_t sector);
+  bool evict_oldest();
+
+  reader_t reader;
+  blkdev_io_pool_t *pool;
+  uint64_t disk_sectors;
+  uint32_t extent_sectors;
+  uint32_t extents_ahead;
+  size_t max_extents;
+
+  // keyed by first sector; extents never overlap
+  std::map<uint64_t, extent_t> extents;
+  // ready extents, oldest first, for eviction
+  std::deque<uint64_t> ready_order;
+  std::vector<stream_t> streams;
+  uint64_t reads = 0;
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t late = 0;
+  uint64_t prefetched = 0;
+  uint64_t prefetches_used = 0;
+};
+
+#endif // __BLOCKDEV_READAHEAD_H
@@ -0,0 +1,141 @@
+// See LICENSE for license details
+
+#include "blockdev_stats.h"
+#include "blockdev.h"
+
+#include <cinttypes>
+#include <cstdlib>
+
+void blkdev_stats_t::histogram_t::add(uint64_t value) {
+  buckets[value ? 64 - __builtin_clzll(value) : 0]++;
+}
+
+void blkdev_stats_t::histogram_t::print(FILE *out,
+                                        const char *name,
+                                        const char *unit) const {
+  fprintf(out, "  %s (%s):", name, unit);
+  for (int n = 0; n < 65; n++) {
+    if (!buckets[n]) {
+      continue;
+    }
+    if (n <= 1) {
+      fprintf(out, " [%d]=%" PRIu64, n, buckets[n]);
+    } else {
+      uint64_t lo = (uint64_t)1 << (n - 1);
+      fprintf(out,
+              " [%" PRIu64 "-%" PRIu64 "]=%" PRIu64,
+              lo,
+              lo + (lo - 1),
+              buckets[n]);
+    }
+  }
+  fprintf(out, "\n");
+}
+
+blkdev_stats_t::blkdev_stats_t(const std::string &filename,
+                               int blkdevno,
+                               uint32_t ntags,
+                               double interval_seconds)
+    : blkdevno(blkdevno), tags(ntags) {
+  this->file = fopen(filename.c_str(), "w");
+  if (!this->file) {
+    fprintf(stderr, "Could not open blockdev stats: %s\n", filename.c_str());
+    abort();
+  }
+  interval = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(interval_seconds));
+  started = clock::now();
+  next_report = started + interval;
+  last_tick = started;
+  previous_tick = started;
+}
+
+blkdev_stats_t::~blkdev_stats_t() { fclose(this->file); }
+
+void blkdev_stats_t::request(bool write, uint32_t sectors, uint32_t tag) {
+  direction_t &dir = write ? writes : reads;
+  dir.requests++;
+  dir.bytes += (uint64_t)sectors << SECTOR_SHIFT;
+  dir.sectors.add(sectors);
+
+  tags_in_use.add(tags_busy);
+  if (tag < tags.size() && !tags[tag].busy) {
+    tags[tag].busy = true;
+    tags[tag].write = write;
+    tags[tag].start = clock::now();
+    tags[tag].requests++;
+    tags_busy++;
+  }
+}
+
+void blkdev_stats_t::complete(uint32_t tag) {
+  tag_t &t = tags[tag];
+  if (!t.busy) {
+    return;
+  }
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+      clock::now() - t.start);
+  (t.write ? writes : reads).service_us.add(us.count());
+  t.busy = false;
+  tags_busy--;
+}
+
+void blkdev_stats_t::sample_stalls(bool rresp, bool wack) {
+  samples++;
+  if (rresp) {
+    rresp_stall_samples++;
+    rresp_stalled += last_tick - previous_tick;
+  }
+  if (wack) {
+    wack_stall_samples++;
+    wack_stalled += last_tick - previous_tick;
+  }
+}
+
+void blkdev_stats_t::tick() {
+  previous_tick = last_tick;
+  last_tick = clock::now();
+  if (interval.count() > 0 && last_tick >= next_report) {
+    report();
+    next_report += interval;
+  }
+}
+
+void blkdev_stats_t::report() {
+  using ms = std::chrono::duration<double, std::milli>;
+  double elapsed =
+      std::chrono::duration<double>(clock::now() - started).count();
+
+  fprintf(file, "blockdev%d after %.1fs\n", blkdevno, elapsed);
+  fprintf(file,
+          "  reads: %" PRIu64 " requests, %" PRIu64 " bytes\n"
+          "  writes: %" PRIu64 " requests, %" PRIu64 " bytes\n",
+          reads.requests,
+          reads.bytes,
+          writes.requests,
+          writes.bytes);
+  reads.sectors.print(file, "read size", "sectors");
+  writes.sectors.print(file, "write size", "sectors");
+  reads.service_us.print(file, "read service time", "us");
+  writes.service_us.print(file, "write service time", "us");
+  tags_in_use.print(file, "tags already in use at request", "tags");
+
+  fprintf(file, "  requests per tag:");
+  for (size_t i = 0; i < tags.size(); i++) {
+    fprintf(file, " %zu=%" PRIu64, i, tags[i].requests);
+  }
+  fprintf(file, "\n");
+
+  fprintf(file,
+          "  widget stalled on read data: %" PRIu64 "/%" PRIu64
+          " ticks, %.3f ms\n"
+          "  widget stalled on write ack: %" PRIu64 "/%" PRIu64
+          " ticks, %.3f ms\n",
+          rresp_stall_samples,
+          samples,
+          ms(rresp_stalled).count(),
+          wack_stall_samples,
+          samples,
+          ms(wack_stalled).count());
+  fflush(file);
+}
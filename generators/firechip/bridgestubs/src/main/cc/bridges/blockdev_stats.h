@@ -0,0 +1,84 @@
+// See LICENSE for license details
+#ifndef __BLOCKDEV_STATS_H
+#define __BLOCKDEV_STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * Runtime telemetry for one block device bridge (+blkdev-statsN=<file>).
+ *
+ * Counts requests and bytes by direction, and keeps log2 histograms of
+ * request sizes, of the host time from taking a request to having its
+ * response ready, and of the number of tags in use when a request arrives.
+ * Widget stalls are sampled once per busy tick; the host time between a
+ * tick that saw the widget stalled and the tick before it is charged as
+ * stalled.
+ * All figures are cumulative and written every interval and at exit.
+ */
+class blkdev_stats_t {
+public:
+  blkdev_stats_t(const std::string &filename,
+                 int blkdevno,
+                 uint32_t ntags,
+                 double interval_seconds);
+  ~blkdev_stats_t();
+
+  void request(bool write, uint32_t sectors, uint32_t tag);
+  // The response to the request on tag is ready to be returned
+  void complete(uint32_t tag);
+  void sample_stalls(bool rresp_stalled, bool wack_stalled);
+
+  // Called on every tick, writes a report if the interval has passed
+  void tick();
+  void report();
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct histogram_t {
+    // bucket n counts values in [2^(n-1), 2^n), bucket 0 counts zeros
+    uint64_t buckets[65] = {};
+    void add(uint64_t value);
+    void print(FILE *out, const char *name, const char *unit) const;
+  };
+
+  struct direction_t {
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    histogram_t sectors;
+    histogram_t service_us;
+  };
+
+  struct tag_t {
+    bool busy = false;
+    bool write;
+    clock::time_point start;
+    uint64_t requests = 0;
+  };
+
+  FILE *file;
+  int blkdevno;
+  clock::duration interval;
+  clock::time_point started;
+  clock::time_point next_report;
+  clock::time_point last_tick;
+  clock::time_point previous_tick;
+
+  direction_t reads;
+  direction_t writes;
+  std::vector<tag_t> tags;
+  uint32_t tags_busy = 0;
+  histogram_t tags_in_use;
+
+  uint64_t samples = 0;
+  uint64_t rresp_stall_samples = 0;
+  uint64_t wack_stall_samples = 0;
+  clock::duration rresp_stalled = clock::duration::zero();
+  clock::duration wack_stalled = clock::duration::zero();
+};
+
+#endif // __BLOCKDEV_STATS_H
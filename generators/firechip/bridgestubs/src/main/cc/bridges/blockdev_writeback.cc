@@ -0,0 +1,145 @@
+// See LICENSE for license details
+
+#include "blockdev_writeback.h"
+#include "blockdev.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+blkdev_writeback_t::blkdev_writeback_t(writer_t writer,
+                                       uint64_t max_bytes,
+                                       double interval_seconds)
+    : writer(std::move(writer)), max_bytes(max_bytes) {
+  interval = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(interval_seconds));
+  next_flush = clock::now() + interval;
+}
+
+blkdev_writeback_t::~blkdev_writeback_t() { flush(); }
+
+void blkdev_writeback_t::write(uint64_t sector,
+                               const void *buf,
+                               uint64_t count) {
+  writes++;
+  bytes_written += count << SECTOR_SHIFT;
+  uint64_t end = sector + count;
+
+  // first extent that overlaps or adjoins the write
+  auto first = extents.upper_bound(sector);
+  if (first != extents.begin() &&
+      sector <= std::prev(first)->first + std::prev(first)->second.count) {
+    --first;
+  }
+
+  // a rewrite of buffered sectors is copied in place
+  if (first != extents.end() && first->first <= sector &&
+      end <= first->first + first->second.count) {
+    uint64_t at = (sector - first->first) << SECTOR_SHIFT;
+    memcpy(first->second.data.data() + at, buf, count << SECTOR_SHIFT);
+    return;
+  }
+
+  uint64_t start = sector;
+  uint64_t stop = end;
+  auto last = first;
+  for (; last != extents.end() && last->first <= end; ++last) {
+    start = std::min(start, last->first);
+    stop = std::max(stop, last->first + last->second.count);
+  }
+
+  // grow the extent the write extends, so that sequential writes append
+  extent_t merged;
+  bool reused = first != last && first->first == start;
+  if (reused) {
+    merged.data = std::move(first->second.data);
+  }
+  merged.count = stop - start;
+  merged.data.resize(merged.count << SECTOR_SHIFT);
+  for (auto it = first; it != last; ++it) {
+    dirty_bytes -= it->second.count << SECTOR_SHIFT;
+    if (it == first && reused) {
+      continue;
+    }
+    memcpy(merged.data.data() + ((it->first - start) << SECTOR_SHIFT),
+           it->second.data.data(),
+           it->second.count << SECTOR_SHIFT);
+  }
+  // the write is newer than anything it overlaps
+  memcpy(merged.data.data() + ((sector - start) << SECTOR_SHIFT),
+         buf,
+         count << SECTOR_SHIFT);
+
+  extents.erase(first, last);
+  dirty_bytes += merged.count << SECTOR_SHIFT;
+  extents.emplace(start, std::move(merged));
+
+  if (dirty_bytes > max_bytes) {
+    flush();
+  }
+}
+
+bool blkdev_writeback_t::overlaps(uint64_t sector, uint64_t count) const {
+  auto it = extents.upper_bound(sector);
+  if (it != extents.begin() &&
+      sector < std::prev(it)->first + std::prev(it)->second.count) {
+    return true;
+  }
+  return it != extents.end() && it->first < sector + count;
+}
+
+void blkdev_writeback_t::patch(uint64_t sector,
+                               uint64_t count,
+                               void *buf) const {
+  uint64_t end = sector + count;
+  auto it = extents.upper_bound(sector);
+  if (it != extents.begin()) {
+    --it;
+  }
+  for (; it != extents.end() && it->first < end; ++it) {
+    uint64_t from = std::max(sector, it->first);
+    uint64_t to = std::min(end, it->first + it->second.count);
+    if (from >= to) {
+      continue;
+    }
+    memcpy((uint8_t *)buf + ((from - sector) << SECTOR_SHIFT),
+           it->second.data.data() + ((from - it->first) << SECTOR_SHIFT),
+           (to - from) << SECTOR_SHIFT);
+  }
+}
+
+void blkdev_writeback_t::tick() {
+  if (clock::now() >= next_flush) {
+    flush();
+  }
+}
+
+void blkdev_writeback_t::flush() {
+  next_flush = clock::now() + interval;
+  if (extents.empty()) {
+    return;
+  }
+
+  // in sector order, so the disk sees one sequential pass
+  for (auto &e : extents) {
+    writer(e.first, e.second.data.data(), e.second.count);
+    bytes_flushed += e.second.count << SECTOR_SHIFT;
+  }
+  extents_flushed += extents.size();
+  flushes++;
+  extents.clear();
+  dirty_bytes = 0;
+}
+
+void blkdev_writeback_t::report(FILE *out, int blkdevno) {
+  fprintf(out,
+          "blockdev%d write-back: %" PRIu64 " writes (%" PRIu64
+          " bytes) flushed as %" PRIu64 " extents (%" PRIu64
+          " bytes) in %" PRIu64 " flushes\n",
+          blkdevno,
+          writes,
+          bytes_written,
+          extents_flushed,
+          bytes_flushed,
+          flushes);
+}
@@ -0,0 +1,71 @@
+// See LICENSE for license details
+#ifndef __BLOCKDEV_WRITEBACK_H
+#define __BLOCKDEV_WRITEBACK_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <vector>
+
+/**
+ * Write-back buffer for the block device (+blkdev-writebackN=<MiB>).
+ *
+ * Completed writes are copied into extents of dirty sectors instead of
+ * going to the disk. A write that overlaps or adjoins buffered extents is
+ * merged with them, so bursts of small writes leave a few large sequential
+ * runs. Everything is written out in sector order when the buffer grows
+ * past its size, once the flush interval has passed, and by flush().
+ *
+ * Reads of the disk return stale data for buffered sectors; patch() copies
+ * the buffered data over them. Only used from the simulation thread.
+ */
+class blkdev_writeback_t {
+public:
+  // Writes nsectors at sector to the disk
+  using writer_t = std::function<void(uint64_t, const void *, uint64_t)>;
+
+  blkdev_writeback_t(writer_t writer,
+                     uint64_t max_bytes,
+                     double interval_seconds);
+  // Writes out everything still buffered
+  ~blkdev_writeback_t();
+
+  void write(uint64_t sector, const void *buf, uint64_t count);
+  // True if any of the sectors are buffered
+  bool overlaps(uint64_t sector, uint64_t count) const;
+  // Copies the buffered sectors among those in buf over it
+  void patch(uint64_t sector, uint64_t count, void *buf) const;
+
+  // Called on every tick, flushes if the interval has passed
+  void tick();
+  void flush();
+
+  void report(FILE *out, int blkdevno);
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct extent_t {
+    uint64_t count;
+    std::vector<uint8_t> data;
+  };
+
+  writer_t writer;
+  uint64_t max_bytes;
+  clock::duration interval;
+  clock::time_point next_flush;
+
+  // keyed by first sector; extents neither overlap nor adjoin
+  std::map<uint64_t, extent_t> extents;
+  uint64_t dirty_bytes = 0;
+
+  uint64_t writes = 0;
+  uint64_t bytes_written = 0;
+  uint64_t flushes = 0;
+  uint64_t extents_flushed = 0;
+  uint64_t bytes_flushed = 0;
+};
+
+#endif // __BLOCKDEV_WRITEBACK_H
@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <filesystem>
+#include <inttypes.h>
 #include <iostream>
 #include <limits.h>
 #include <stdint.h>
@@ -69,32 +70,117 @@ cospike_t::cospike_t(simif_t &sim,
   this->cospike_exit_code = 0;
 
   const std::string cospiketrace_arg = std::string("+cospike-trace=");
+  const std::string hugepages_arg = std::string("+cospike-trace-hugepages");
+  const std::string numa_arg = std::string("+cospike-trace-numa-node=");
+  const std::string capture_arg = std::string("+cospike-raw-capture=");
+  const char *capture_prefix = nullptr;
+  // sampling controls for trace mode, see trace_sampler_t
+  const std::string cycles_arg = std::string("+cospike-trace-cycles=");
+  const std::string pcstart_arg = std::string("+cospike-trace-pc-start=");
+  const std::string pcend_arg = std::string("+cospike-trace-pc-end=");
+  const std::string sample_arg = std::string("+cospike-trace-sample=");
+  trace_sampler_t sampler(this->_trace_cfg);
+  bool pc_start_given = false;
+  uint64_t pc_start = 0, pc_end = 0;
+  // depth of the always-on flight recorder, 0 disables it
+  const std::string flightrec_arg = std::string("+cospike-flight-recorder=");
+  size_t flight_recorder_depth = 1024;
+  int num_threads = 0;
+  mempool_placement_t placement;
   for (auto &arg : args) {
     if (arg.find(cospiketrace_arg) == 0) {
       char *str = const_cast<char *>(arg.c_str()) + cospiketrace_arg.length();
-      int num_threads = atol(str);
-      this->_trace_printers.start(num_threads);
-
-      size_t max_input_bytes = stream_depth * STREAM_WIDTH_BYTES;
-      size_t buffer_bytes =
-          num_threads * max_input_bytes; // based on perf experiments
-      this->_trace_mempool =
-          new mempool_t(num_threads, buffer_bytes, max_input_bytes);
-
-      std::filesystem::create_directory("COSPIKE-TRACES");
-
-      FILE *config_file = fopen("COSPIKE-CONFIG", "w");
-      fprintf(config_file,
-              "num_threads: %d uncompressed_buffer_bytes: %lu\n",
-              num_threads,
-              buffer_bytes);
-      fclose(config_file);
-
-      FILE *bootrom_file = fopen("FIRESIM-BOOTROM", "w");
-      fprintf(bootrom_file, "%s\n", bootrom);
-      fclose(bootrom_file);
+      num_threads = atol(str);
     }
+    if (arg.find(hugepages_arg) == 0) {
+      placement.hugepages = true;
+    }
+    // "local" binds to the node the simulation thread is running on
+    if (arg.find(numa_arg) == 0) {
+      const char *str = arg.c_str() + numa_arg.length();
+      placement.numa_node =
+          (strcmp(str, "local") == 0) ? numa_local_node() : atoi(str);
+    }
+    if (arg.find(capture_arg) == 0) {
+      capture_prefix = arg.c_str() + capture_arg.length();
+    }
+    if (arg.find(cycles_arg) == 0 &&
+        !sampler.add_cycle_windows(arg.substr(cycles_arg.length()))) {
+      fprintf(stderr, "Invalid cycle windows: %s\n", arg.c_str());
+      abort();
+    }
+    if (arg.find(pcstart_arg) == 0) {
+      pc_start = strtoull(arg.c_str() + pcstart_arg.length(), nullptr, 16);
+      pc_start_given = true;
+    }
+    if (arg.find(pcend_arg) == 0) {
+      pc_end = strtoull(arg.c_str() + pcend_arg.length(), nullptr, 16);
+    }
+    if (arg.find(sample_arg) == 0 &&
+        !sampler.set_periodic(arg.substr(sample_arg.length()))) {
+      fprintf(stderr, "Invalid sampling period: %s\n", arg.c_str());
+      abort();
+    }
+    if (arg.find(flightrec_arg) == 0) {
+      flight_recorder_depth =
+          strtoull(arg.c_str() + flightrec_arg.length(), nullptr, 10);
+    }
+  }
+  if (pc_start_given) {
+    sampler.set_pc_window(pc_start, pc_end);
+  }
+  // only cosimulation checks records, trace and capture modes never feed it
+  if (flight_recorder_depth > 0 && num_threads == 0 && !capture_prefix) {
+    this->_flight_recorder = new flight_recorder_t(flight_recorder_depth);
   }
+
+  if (capture_prefix) {
+    char header[128];
+    snprintf(header,
+             sizeof(header),
+             "# hartid: %u bits_per_trace: %u\n",
+             hartid,
+             bits_per_trace);
+    this->_capture =
+        new mmap_capture_t(std::string(capture_prefix) + "-" +
+                               std::to_string(hartid),
+                           header);
+  }
+
+  if (num_threads > 0) {
+    // printer threads (the consumers) run on the node the buffers live on
+    this->_trace_printers.start(
+        num_threads, num_threads, placement.numa_node);
+
+    size_t max_input_bytes = stream_depth * STREAM_WIDTH_BYTES;
+    size_t buffer_bytes =
+        num_threads * max_input_bytes; // based on perf experiments
+    this->_trace_mempool =
+        new mempool_t(num_threads, buffer_bytes, max_input_bytes, placement);
+
+    std::filesystem::create_directory("COSPIKE-TRACES");
+
+    FILE *config_file = fopen("COSPIKE-CONFIG", "w");
+    fprintf(config_file,
+            "num_threads: %d uncompressed_buffer_bytes: %lu\n",
+            num_threads,
+            buffer_bytes);
+    fclose(config_file);
+
+    FILE *bootrom_file = fopen("FIRESIM-BOOTROM", "w");
+    fprintf(bootrom_file, "%s\n", bootrom);
+    fclose(bootrom_file);
+
+    if (sampler.enabled()) {
+      this->_trace_sampler = new trace_sampler_t(sampler);
+    }
+  }
+}
+
+cospike_t::~cospike_t() {
+  delete this->_flight_recorder;
+  delete this->_capture;
+  delete this->_trace_sampler;
 }
 
 /**
@@ -165,6 +251,10 @@ int cospike_t::invoke_cospike(uint8_t *buf) {
 #endif
 
   if (valid || exception || cause) {
+    if (this->_flight_recorder) {
+      this->_flight_recorder->append(
+          {time, iaddr, cause, wdata, insn, priv, valid, exception, interrupt});
+    }
     return cospike_cosim(time, // TODO: No cycle given
                          this->_hartid,
                          (cfg._wdata_width != 0),
@@ -181,33 +271,53 @@ int cospike_t::invoke_cospike(uint8_t *buf) {
   }
 }
 
-size_t cospike_t::record_trace(size_t max_batch_bytes, size_t min_batch_bytes) {
-  assert(!_trace_mempool->full());
+/**
+ * Pull straight into the memory-mapped capture file
+ */
+size_t cospike_t::capture_trace(size_t max_batch_bytes,
+                                size_t min_batch_bytes) {
   size_t bytes_received = pull(stream_idx,
-                               _trace_mempool->next_empty(),
+                               _capture->reserve(max_batch_bytes),
                                max_batch_bytes,
                                min_batch_bytes);
+  _capture->commit(bytes_received);
+  return bytes_received;
+}
+
+size_t cospike_t::record_trace(size_t max_batch_bytes, size_t min_batch_bytes) {
+  assert(!_trace_mempool->full());
+  uint8_t *batch = _trace_mempool->next_empty();
+  size_t bytes_received =
+      pull(stream_idx, batch, max_batch_bytes, min_batch_bytes);
   if (bytes_received > 0) {
-    _trace_mempool->fill(bytes_received);
+    size_t bytes_kept = bytes_received;
+    if (_trace_sampler) {
+      bytes_kept = _trace_sampler->filter(batch, bytes_received);
+      // keep the next pull destination token aligned, zero records are
+      // skipped by the printers
+      size_t padded = (bytes_kept + STREAM_WIDTH_BYTES - 1) /
+                      STREAM_WIDTH_BYTES * STREAM_WIDTH_BYTES;
+      memset(batch + bytes_kept, 0, padded - bytes_kept);
+      bytes_kept = padded;
+    }
+    _trace_mempool->fill(bytes_kept);
 
-    // if the buffer is full, push it to the threadpool
+    // if the buffer is full, push it to the threadpool and wait (with
+    // backoff) until the next buffer has been released by a printer thread
     if (_trace_mempool->full()) {
-      while (_trace_mempool->next_buffer_full()) {
-        ;
-      }
       std::string ofname = "COSPIKE-TRACES/COSPIKE-TRACE-" +
                            std::to_string(this->_hartid) + "-" +
                            std::to_string(this->_file_idx++) + ".gz";
       trace_t trace = {_trace_mempool->cur_buf(), this->_trace_cfg};
-      _trace_printers.queue_job(print_insn_logs, trace, ofname);
       _trace_mempool->advance_buffer();
+      _trace_printers.queue_job(print_insn_logs, trace, ofname);
+      _trace_mempool->wait_buffer();
     }
   }
   return bytes_received;
 }
 
 size_t cospike_t::run_cosim(size_t max_batch_bytes, size_t min_batch_bytes) {
-  // TODO: as opt can mmap file and just load directly into it.
   page_aligned_sized_array(OUTBUF, max_batch_bytes);
   size_t bytes_received =
       pull(stream_idx, OUTBUF, max_batch_bytes, min_batch_bytes);
@@ -237,6 +347,7 @@ size_t cospike_t::run_cosim(size_t max_batch_bytes, size_t min_batch_bytes) {
       cospike_failed = true;
       cospike_exit_code = rval;
       printf("[ERROR] Cospike: Errored during simulation with %d\n", rval);
+      dump_flight_recorder();
 
 #ifdef DEBUG
       fprintf(stderr, "Off(%lu) token(", offset / bytes_per_trace);
@@ -273,7 +384,9 @@ size_t cospike_t::process_tokens(int num_beats, size_t minimum_batch_beats) {
   const size_t minimum_batch_bytes = minimum_batch_beats * STREAM_WIDTH_BYTES;
 
   size_t bytes_received;
-  if (this->_trace_mempool) {
+  if (this->_capture) {
+    bytes_received = capture_trace(maximum_batch_bytes, minimum_batch_bytes);
+  } else if (this->_trace_mempool) {
     bytes_received = record_trace(maximum_batch_bytes, minimum_batch_bytes);
   } else {
     bytes_received = run_cosim(maximum_batch_bytes, minimum_batch_bytes);
@@ -297,6 +410,48 @@ void cospike_t::flush() {
   while (!cospike_failed && (this->process_tokens(this->stream_depth, 0) > 0))
     ;
 
-  if (this->_trace_mempool)
+  if (this->_trace_mempool) {
     this->_trace_printers.stop();
+    printf("[INFO] Cospike: Trace producer stalled %" PRIu64
+           " times (%.3f ms) waiting for a free buffer and %" PRIu64
+           " times (%.3f ms) waiting for a job slot\n",
+           _trace_mempool->stall_events(),
+           _trace_mempool->stall_ns() / 1e6,
+           _trace_printers.producer_stall_events(),
+           _trace_printers.producer_stall_ns() / 1e6);
+    if (_trace_sampler) {
+      printf("[INFO] Cospike: Sampling kept %" PRIu64 " and dropped %" PRIu64
+             " records\n",
+             _trace_sampler->records_kept(),
+             _trace_sampler->records_dropped());
+    }
+  }
+}
+
+/**
+ * Write the flight recorder history (ending at the failing record, if any)
+ */
+void cospike_t::dump_flight_recorder() {
+  if (!this->_flight_recorder || this->_flight_recorder->empty() ||
+      this->_flight_recorder_dumped) {
+    return;
+  }
+  std::string fname =
+      "COSPIKE-FLIGHT-RECORDER-" + std::to_string(this->_hartid);
+  FILE *file = fopen(fname.c_str(), "w");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", fname.c_str());
+    return;
+  }
+  this->_flight_recorder->dump(
+      file, this->_hartid, this->_trace_cfg._wdata_width != 0);
+  fclose(file);
+  this->_flight_recorder_dumped = true;
+  printf("[INFO] Cospike: Wrote last committed instructions to %s\n",
+         fname.c_str());
+}
+
+void cospike_t::finish() {
+  this->flush();
+  this->dump_flight_recorder();
 }
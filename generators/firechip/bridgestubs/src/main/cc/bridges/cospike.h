@@ -2,8 +2,11 @@
 #ifndef __COSPIKE_H
 #define __COSPIKE_H
 
+#include "bridges/cospike/flight_recorder.h"
 #include "bridges/cospike/mem_pool.h"
 #include "bridges/cospike/thread_pool.h"
+#include "bridges/cospike/trace_sampler.h"
+#include "bridges/mmap_capture.h"
 #include "core/bridge_driver.h"
 #include <string>
 #include <vector>
@@ -40,20 +43,22 @@ public:
             uint32_t stream_idx,
             uint32_t stream_depth);
 
-  ~cospike_t() override = default;
+  ~cospike_t() override;
 
   void init() override;
   void tick() override;
   bool terminate() override { return cospike_failed; };
   int exit_code() override { return (cospike_failed) ? cospike_exit_code : 0; };
-  void finish() override { this->flush(); };
+  void finish() override;
 
 private:
+  size_t capture_trace(size_t max_batch_bytes, size_t min_batch_bytes);
   size_t record_trace(size_t max_batch_bytes, size_t min_batch_bytes);
   size_t run_cosim(size_t max_batch_bytes, size_t min_batch_bytes);
   int invoke_cospike(uint8_t *buf);
   size_t process_tokens(int num_beats, size_t minimum_batch_beats);
   void flush();
+  void dump_flight_recorder();
 
   std::vector<std::string> args;
 
@@ -87,6 +92,15 @@ private:
   int _file_idx = 0;
   threadpool_t<trace_t, std::string> _trace_printers;
   mempool_t *_trace_mempool = nullptr;
+  // drops records outside of the requested windows before they are buffered
+  trace_sampler_t *_trace_sampler = nullptr;
+
+  // history of the last records handed to cospike, dumped on a mismatch
+  flight_recorder_t *_flight_recorder = nullptr;
+  bool _flight_recorder_dumped = false;
+
+  // raw capture of the stream, without cosimulation or decoding
+  mmap_capture_t *_capture = nullptr;
 };
 
 #endif // __COSPIKE_H
@@ -0,0 +1,36 @@
+#include "flight_recorder.h"
+#include <inttypes.h>
+
+flight_recorder_t::flight_recorder_t(size_t depth) {
+  size_t sz = 1;
+  while (sz < depth) {
+    sz <<= 1;
+  }
+  this->ring.resize(sz);
+  this->mask = sz - 1;
+}
+
+void flight_recorder_t::dump(FILE *file, int hartid, bool has_wdata) const {
+  uint64_t start = (head > ring.size()) ? head - ring.size() : 0;
+  fprintf(file,
+          "# hartid time pc insn valid exception interrupt has_wdata cause "
+          "wdata priv (%" PRIu64 " of %" PRIu64 " records)\n",
+          head - start,
+          head);
+  for (uint64_t i = start; i < head; i++) {
+    const flight_record_t &rec = ring[i & mask];
+    fprintf(file,
+            "%d %" PRIu64 " %" PRIx64 " %08x %d %d %d %d %d %" PRIx64 " %d\n",
+            hartid,
+            rec.time,
+            rec.iaddr,
+            rec.insn,
+            rec.valid,
+            rec.exception,
+            rec.interrupt,
+            has_wdata,
+            (int)rec.cause,
+            rec.wdata,
+            rec.priv);
+  }
+}
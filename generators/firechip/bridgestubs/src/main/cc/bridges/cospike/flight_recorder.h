@@ -0,0 +1,43 @@
+#ifndef __FLIGHT_RECORDER_H__
+#define __FLIGHT_RECORDER_H__
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+
+// a decoded trace record, kept unformatted so that appends stay cheap
+struct flight_record_t {
+  uint64_t time;
+  uint64_t iaddr;
+  uint64_t cause;
+  uint64_t wdata;
+  uint32_t insn;
+  uint8_t priv;
+  bool valid;
+  bool exception;
+  bool interrupt;
+};
+
+/**
+ * Fixed-size ring of the last N records handed to cospike for one hart.
+ * Formatting only happens in dump(), on a mismatch or at the end of the
+ * simulation.
+ */
+class flight_recorder_t {
+public:
+  // depth is rounded up to the next power of two
+  explicit flight_recorder_t(size_t depth);
+
+  void append(const flight_record_t &rec) { ring[head++ & mask] = rec; }
+  bool empty() const { return head == 0; }
+
+  // writes the recorded history, oldest first
+  void dump(FILE *file, int hartid, bool has_wdata) const;
+
+private:
+  std::vector<flight_record_t> ring;
+  uint64_t mask;
+  uint64_t head = 0;
+};
+
+#endif //__FLIGHT_RECORDER_H__
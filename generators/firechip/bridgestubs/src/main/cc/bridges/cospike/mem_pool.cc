@@ -1,24 +1,157 @@
 #include "mem_pool.h"
+#include "mpmc_queue.h"
 #include <assert.h>
+#include <chrono>
+#include <linux/mempolicy.h>
 #include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #define PAGE_SIZE_BYTES 4096
+#define HUGEPAGE_SIZE_BYTES (2 * 1024 * 1024)
 
-buffer_t::buffer_t(size_t sz, size_t max_input_sz) {
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+int numa_local_node() {
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return -1;
+  }
+  return node;
+}
+
+bool numa_node_cpus(int node, cpu_set_t *set) {
+  std::string path =
+      "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) {
+    return false;
+  }
+  CPU_ZERO(set);
+  // cpulist is formatted as comma separated ranges, e.g. "0-11,24-35"
+  unsigned lo, hi;
+  int matched;
+  while ((matched = fscanf(fp, "%u-%u", &lo, &hi)) > 0) {
+    if (matched == 1) {
+      hi = lo;
+    }
+    for (unsigned cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if (fgetc(fp) != ',') {
+      break;
+    }
+  }
+  fclose(fp);
+  return CPU_COUNT(set) > 0;
+}
+
+// Map sz bytes for a trace buffer, preferring explicit 2MB hugepages. The
+// mapping is not populated so that a NUMA policy can be applied first.
+static uint8_t *map_buffer(size_t sz, bool hugepages) {
+  void *p = MAP_FAILED;
+  if (hugepages) {
+    p = mmap(nullptr,
+             sz,
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,
+             -1,
+             0);
+    static bool warned = false;
+    if (p == MAP_FAILED && !warned) {
+      fprintf(stderr,
+              "[WARN] Cospike: No 2MB hugepages reserved, falling back to "
+              "transparent hugepages\n");
+      warned = true;
+    }
+  }
+  if (p == MAP_FAILED) {
+    p = mmap(nullptr,
+             sz,
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS,
+             -1,
+             0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      abort();
+    }
+    if (hugepages) {
+      madvise(p, sz, MADV_HUGEPAGE);
+    }
+  }
+  return (uint8_t *)p;
+}
+
+static void bind_buffer(uint8_t *data, size_t sz, int node) {
+  unsigned long nodemask[16] = {0};
+  const unsigned long bits_per_word = sizeof(unsigned long) * 8;
+  if (node < 0 || (size_t)node >= sizeof(nodemask) * 8) {
+    return;
+  }
+  nodemask[node / bits_per_word] |= 1UL << (node % bits_per_word);
+  if (syscall(SYS_mbind,
+              data,
+              sz,
+              MPOL_BIND,
+              nodemask,
+              sizeof(nodemask) * 8,
+              0) != 0) {
+    perror("[WARN] Cospike: mbind");
+  }
+}
+
+buffer_t::buffer_t(size_t sz,
+                   size_t max_input_sz,
+                   const mempool_placement_t &placement) {
   size_t remain_bytes = (sz % PAGE_SIZE_BYTES) == 0 ? 0 : PAGE_SIZE_BYTES;
   this->sz = (sz / PAGE_SIZE_BYTES) * PAGE_SIZE_BYTES + remain_bytes;
-  this->data = (uint8_t *)aligned_alloc(PAGE_SIZE_BYTES, this->sz);
+  this->mapped = placement.prefault();
+  if (this->mapped) {
+    // only the mapping is rounded up to whole hugepages, the buffer still
+    // fills up to sz
+    const size_t align =
+        placement.hugepages ? HUGEPAGE_SIZE_BYTES : PAGE_SIZE_BYTES;
+    this->map_sz = (this->sz + align - 1) / align * align;
+    this->data = map_buffer(this->map_sz, placement.hugepages);
+    bind_buffer(this->data, this->map_sz, placement.numa_node);
+    // pre-fault so the stream pull path never takes a page fault mid-run
+    for (size_t off = 0; off < this->map_sz; off += PAGE_SIZE_BYTES) {
+      this->data[off] = 0;
+    }
+  } else {
+    this->data = (uint8_t *)aligned_alloc(PAGE_SIZE_BYTES, this->sz);
+  }
   this->offset = 0;
   this->max_input_sz = max_input_sz;
+  this->busy.store(false, std::memory_order_relaxed);
 
   assert(sz >= max_input_sz);
 }
 
-buffer_t::~buffer_t() { free(data); }
+buffer_t::~buffer_t() {
+  if (mapped) {
+    munmap(data, map_sz);
+  } else {
+    free(data);
+  }
+}
 
 bool buffer_t::almost_full() { return (sz - offset) < max_input_sz; }
 
-void buffer_t::clear() { offset = 0; }
+void buffer_t::clear() {
+  offset = 0;
+  busy.store(false, std::memory_order_release);
+}
+
+bool buffer_t::in_flight() { return busy.load(std::memory_order_acquire); }
+
+void buffer_t::mark_in_flight() { busy.store(true, std::memory_order_relaxed); }
 
 uint8_t *buffer_t::next_empty() { return (data + offset); }
 
@@ -31,13 +164,21 @@ uint8_t *buffer_t::get_data() { return data; }
 
 size_t buffer_t::bytes() { return offset; }
 
-mempool_t::mempool_t(int buf_cnt, size_t buf_sz, size_t max_input_sz) {
+mempool_t::mempool_t(int buf_cnt,
+                     size_t buf_sz,
+                     size_t max_input_sz,
+                     const mempool_placement_t &placement) {
   this->head = 0;
   this->count = buf_cnt;
   for (int i = 0; i < buf_cnt; i++) {
-    this->buffers.push_back(new buffer_t(buf_sz, max_input_sz));
+    this->buffers.push_back(new buffer_t(buf_sz, max_input_sz, placement));
   }
   printf("Allocating a total of %ld Bytes\n", buf_cnt * buf_sz);
+  if (placement.prefault()) {
+    printf("  hugepages: %d, NUMA node: %d (pre-faulted)\n",
+           placement.hugepages,
+           placement.numa_node);
+  }
 }
 
 mempool_t::~mempool_t() {
@@ -67,13 +208,26 @@ buffer_t *mempool_t::cur_buf() {
   return buf;
 }
 
-bool mempool_t::next_buffer_full() {
-  int next_head = (head + 1) % count;
-  buffer_t *next_buffer = buffers[next_head];
-  return next_buffer->almost_full();
-}
-
+// hands the current buffer off to a consumer and moves to the next one
 void mempool_t::advance_buffer() {
+  buffers[head]->mark_in_flight();
   head = (head + 1) % count;
-  assert(!buffers[head]->almost_full());
+}
+
+// blocks (with backoff) until a consumer has released the current buffer
+void mempool_t::wait_buffer() {
+  buffer_t *buf = buffers[head];
+  if (!buf->in_flight()) {
+    return;
+  }
+  auto stall_start = std::chrono::steady_clock::now();
+  backoff_t backoff;
+  do {
+    backoff.pause();
+  } while (buf->in_flight());
+  _stall_events++;
+  _stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - stall_start)
+                   .count();
+  assert(!buf->almost_full());
 }
@@ -1,17 +1,40 @@
 #ifndef __MEM_POOL_H__
 #define __MEM_POOL_H__
 
+#include <atomic>
 #include <inttypes.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <vector>
 
+// where and how trace buffers are allocated
+struct mempool_placement_t {
+  // back buffers with 2MB hugepages (falls back to THP if none are reserved)
+  bool hugepages = false;
+  // bind buffers to this NUMA node (-1 leaves placement to the kernel)
+  int numa_node = -1;
+
+  // buffers are pre-faulted whenever a non-default placement is requested
+  bool prefault() const { return hugepages || numa_node >= 0; }
+};
+
+// returns the NUMA node of the CPU the calling thread is running on
+int numa_local_node();
+// fills set with the CPUs of a NUMA node, returns false if unavailable
+bool numa_node_cpus(int node, cpu_set_t *set);
+
 class buffer_t {
 public:
-  buffer_t(size_t sz, size_t max_input_sz);
+  buffer_t(size_t sz,
+           size_t max_input_sz,
+           const mempool_placement_t &placement = mempool_placement_t());
   ~buffer_t();
 
   bool almost_full();
+  // releases the buffer back to the producer
   void clear();
+  bool in_flight();
+  void mark_in_flight();
   uint8_t *next_empty();
   void fill(size_t amount);
   uint8_t *get_data();
@@ -22,24 +45,39 @@ private:
   size_t sz;
   size_t offset;
   uint8_t *data;
+  // set if data was mmap'd rather than allocated from the heap
+  bool mapped;
+  // length of the mapping, sz rounded up to the page size used
+  size_t map_sz;
+  // set while a printer thread owns the buffer
+  std::atomic<bool> busy;
 };
 
 class mempool_t {
 public:
-  mempool_t(int buf_cnt, size_t buf_sz, size_t max_input_sz);
+  mempool_t(int buf_cnt,
+            size_t buf_sz,
+            size_t max_input_sz,
+            const mempool_placement_t &placement = mempool_placement_t());
   ~mempool_t();
 
   bool full();
   uint8_t *next_empty();
   void fill(size_t amount);
   buffer_t *cur_buf();
-  bool next_buffer_full();
   void advance_buffer();
+  void wait_buffer();
+
+  // number of times (and total time) the producer waited on a printer thread
+  uint64_t stall_events() const { return _stall_events; }
+  uint64_t stall_ns() const { return _stall_ns; }
 
 private:
   int count;
   int head;
   std::vector<buffer_t *> buffers;
+  uint64_t _stall_events = 0;
+  uint64_t _stall_ns = 0;
 };
 
 #endif //__MEM_POOL_H__
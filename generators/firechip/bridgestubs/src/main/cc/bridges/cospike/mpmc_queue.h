@@ -0,0 +1,153 @@
+#ifndef __MPMC_QUEUE_H__
+#define __MPMC_QUEUE_H__
+
+/* Bounded MPMC queue based on Dmitry Vyukov's design:
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#define CACHE_LINE_BYTES 64
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#else
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+/**
+ * Exponential backoff for waiters that expect to be released soon but must
+ * not burn a core if they are not: spin briefly, then yield, then sleep with
+ * a geometrically growing (capped) interval.
+ */
+class backoff_t {
+public:
+  void pause() {
+    if (iter < SPIN_ITERS) {
+      for (uint32_t i = 0; i < (1u << iter); i++) {
+        cpu_relax();
+      }
+    } else if (iter < SPIN_ITERS + YIELD_ITERS) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+      sleep_us = std::min<uint32_t>(sleep_us * 2, MAX_SLEEP_US);
+    }
+    iter++;
+  }
+
+  void reset() {
+    iter = 0;
+    sleep_us = 1;
+  }
+
+private:
+  static constexpr uint32_t SPIN_ITERS = 8;
+  static constexpr uint32_t YIELD_ITERS = 16;
+  static constexpr uint32_t MAX_SLEEP_US = 1000;
+
+  uint32_t iter = 0;
+  uint32_t sleep_us = 1;
+};
+
+template <class T>
+class mpmc_queue_t {
+public:
+  // capacity is rounded up to the next power of two
+  explicit mpmc_queue_t(size_t capacity) {
+    size_t sz = 2;
+    while (sz < capacity) {
+      sz <<= 1;
+    }
+    this->mask = sz - 1;
+    this->cells.reset(new cell_t[sz]);
+    for (size_t i = 0; i < sz; i++) {
+      this->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    this->enqueue_pos.store(0, std::memory_order_relaxed);
+    this->dequeue_pos.store(0, std::memory_order_relaxed);
+  }
+
+  mpmc_queue_t(const mpmc_queue_t &) = delete;
+  mpmc_queue_t &operator=(const mpmc_queue_t &) = delete;
+
+  // returns false if the queue is full
+  bool try_push(T &&data) {
+    cell_t *cell;
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells[pos & mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(data);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if the queue is empty
+  bool try_pop(T &data) {
+    cell_t *cell;
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells[pos & mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    data = std::move(cell->data);
+    cell->seq.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // only a hint while producers/consumers are active
+  bool empty() const {
+    return enqueue_pos.load(std::memory_order_acquire) ==
+           dequeue_pos.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+private:
+  struct cell_t {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  std::unique_ptr<cell_t[]> cells;
+  size_t mask;
+  alignas(CACHE_LINE_BYTES) std::atomic<size_t> enqueue_pos;
+  alignas(CACHE_LINE_BYTES) std::atomic<size_t> dequeue_pos;
+};
+
+#endif //__MPMC_QUEUE_H__
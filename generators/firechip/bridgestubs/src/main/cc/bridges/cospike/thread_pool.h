@@ -4,13 +4,17 @@
 /* https://stackoverflow.com/questions/15752659/thread-pooling-in-c11 */
 
 #include "mem_pool.h"
+#include "mpmc_queue.h"
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <pthread.h>
 #include <string>
 #include <thread>
 #include <utility>
@@ -125,83 +129,99 @@ struct trace_t {
 
 template <class T, class S>
 class threadpool_t {
-  using job_t = std::function<void(T, S)>;
+  using job_t = void (*)(T, const S &);
+
+  // self-contained unit of work handed to the printer threads
+  struct job_record_t {
+    job_t job = nullptr;
+    T trace;
+    S oname;
+  };
 
 public:
-  void start(uint32_t max_concurrency) {
+  // numa_node >= 0 restricts the worker threads to the CPUs of that node
+  void start(uint32_t max_concurrency, size_t max_jobs, int numa_node = -1) {
     const uint32_t num_threads = std::max(
         std::thread::hardware_concurrency() / 16,
         std::min(std::thread::hardware_concurrency(), max_concurrency));
+    jobs.reset(new mpmc_queue_t<job_record_t>(max_jobs));
+    cpu_set_t node_cpus;
+    bool pin = (numa_node >= 0) && numa_node_cpus(numa_node, &node_cpus);
     for (uint32_t ii = 0; ii < num_threads; ++ii) {
       threads.emplace_back(std::thread(&threadpool_t::threadloop, this));
+      if (pin) {
+        pthread_setaffinity_np(
+            threads.back().native_handle(), sizeof(node_cpus), &node_cpus);
+      }
     }
   }
 
-  void queue_job(const job_t &job, const T &trace, S &oname) {
-    {
-      std::unique_lock<std::mutex> lock(queue_mutex);
-      jobs.push(job);
-      traces.push(trace);
-      ofnames.push(oname);
+  void queue_job(job_t job, const T &trace, const S &oname) {
+    job_record_t rec = {job, trace, oname};
+    if (!jobs->try_push(std::move(rec))) {
+      // every slot is taken, wait for a printer thread to pick a job up
+      auto stall_start = std::chrono::steady_clock::now();
+      backoff_t backoff;
+      do {
+        backoff.pause();
+      } while (!jobs->try_push(std::move(rec)));
+      stall_events++;
+      stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - stall_start)
+                      .count();
     }
-    mutex_condition.notify_one();
+    idle_condition.notify_one();
   }
 
   void stop() {
     {
-      std::unique_lock<std::mutex> lock(queue_mutex);
+      std::unique_lock<std::mutex> lock(idle_mutex);
       should_terminate = true;
     }
-    mutex_condition.notify_all();
+    idle_condition.notify_all();
     for (std::thread &active_thread : threads) {
       active_thread.join();
     }
     threads.clear();
   }
 
-  bool busy() {
-    bool poolbusy;
-    {
-      std::unique_lock<std::mutex> lock(queue_mutex);
-      poolbusy = !jobs.empty();
-    }
-    return poolbusy;
-  }
+  bool busy() { return jobs && !jobs->empty(); }
+
+  // number of times (and total time) queue_job blocked on a full queue
+  uint64_t producer_stall_events() const { return stall_events; }
+  uint64_t producer_stall_ns() const { return stall_ns; }
 
 private:
   void threadloop() {
+    job_record_t rec;
     while (true) {
-      job_t job;
-      T trace;
-      S oname;
-      {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        mutex_condition.wait(
-            lock, [this] { return !jobs.empty() || should_terminate; });
-        if (should_terminate) {
-          return;
-        }
-        job = jobs.front();
-        jobs.pop();
-
-        trace = traces.front();
-        traces.pop();
-
-        oname = ofnames.front();
-        ofnames.pop();
+      if (jobs->try_pop(rec)) {
+        rec.job(rec.trace, rec.oname);
+        continue;
       }
-      job(trace, oname);
+      // only exit once all outstanding jobs are drained
+      if (should_terminate.load(std::memory_order_acquire)) {
+        return;
+      }
+      // the timeout guards against a notify racing with the wait
+      std::unique_lock<std::mutex> lock(idle_mutex);
+      idle_condition.wait_for(lock, std::chrono::milliseconds(1), [this] {
+        return !jobs->empty() || should_terminate;
+      });
     }
   }
 
-  bool should_terminate = false; // Tells threads to stop looking for jobs
-  std::mutex queue_mutex;        // Prevents data races to the job queue
+  // Tells threads to stop looking for jobs once the queue is drained
+  std::atomic<bool> should_terminate{false};
+  std::mutex idle_mutex; // Only used to park idle threads
   std::condition_variable
-      mutex_condition; // Allows threads to wait on new jobs or termination
+      idle_condition; // Allows threads to wait on new jobs or termination
   std::vector<std::thread> threads;
-  std::queue<job_t> jobs;
-  std::queue<T> traces;
-  std::queue<S> ofnames;
+  std::unique_ptr<mpmc_queue_t<job_record_t>> jobs;
+
+  // only touched by the (single) producer thread
+  uint64_t stall_events = 0;
+  uint64_t stall_ns = 0;
 };
 
 void print_insn_logs(trace_t trace, const std::string &oname);
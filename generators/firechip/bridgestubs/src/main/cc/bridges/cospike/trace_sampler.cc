@@ -0,0 +1,110 @@
+#include "trace_sampler.h"
+#include <algorithm>
+#include <cstdlib>
+#include <string.h>
+
+bool trace_sampler_t::add_cycle_windows(const std::string &spec) {
+  const char *str = spec.c_str();
+  while (*str) {
+    char *end;
+    uint64_t start = strtoull(str, &end, 10);
+    if (*end != ':') {
+      return false;
+    }
+    uint64_t stop = strtoull(end + 1, &end, 10);
+    if (stop <= start || (*end != ',' && *end != '\0')) {
+      return false;
+    }
+    cycle_windows.emplace_back(start, stop);
+    str = (*end == ',') ? end + 1 : end;
+  }
+  std::sort(cycle_windows.begin(), cycle_windows.end());
+  return true;
+}
+
+void trace_sampler_t::set_pc_window(uint64_t pc_start, uint64_t pc_end) {
+  this->pc_window = true;
+  this->pc_start = pc_start;
+  this->pc_end = pc_end;
+}
+
+bool trace_sampler_t::set_periodic(const std::string &spec) {
+  char *end;
+  uint64_t len = strtoull(spec.c_str(), &end, 10);
+  if (*end != ':') {
+    return false;
+  }
+  uint64_t period = strtoull(end + 1, &end, 10);
+  if (*end != '\0' || len == 0 || period < len) {
+    return false;
+  }
+  this->sample_len = len;
+  this->sample_period = period;
+  return true;
+}
+
+bool trace_sampler_t::keep(uint64_t time, uint64_t iaddr) {
+  if (!cycle_windows.empty()) {
+    // records arrive in time order, so windows can be retired as we go
+    while (cycle_idx < cycle_windows.size() &&
+           time >= cycle_windows[cycle_idx].second) {
+      cycle_idx++;
+    }
+    if (cycle_idx == cycle_windows.size() ||
+        time < cycle_windows[cycle_idx].first) {
+      return false;
+    }
+  }
+
+  if (pc_window) {
+    if (!pc_active) {
+      if (iaddr != pc_start) {
+        return false;
+      }
+      pc_active = true;
+    } else if (iaddr == pc_end) {
+      // keep the closing record itself
+      pc_active = false;
+    }
+  }
+
+  if (sample_period != 0) {
+    bool in_sample = sample_pos < sample_len;
+    sample_pos = (sample_pos + 1 == sample_period) ? 0 : sample_pos + 1;
+    return in_sample;
+  }
+  return true;
+}
+
+size_t trace_sampler_t::filter(uint8_t *buf, size_t bytes) {
+  const size_t bytes_per_trace = cfg._bits_per_trace / 8;
+  uint8_t *out = buf;
+
+  for (size_t offset = 0; offset + bytes_per_trace <= bytes;
+       offset += bytes_per_trace) {
+    uint8_t *cur_buf = buf + offset;
+    bool valid = cur_buf[cfg._valid_offset];
+    bool exception = cur_buf[cfg._exception_offset];
+    uint64_t cause = EXTRACT_ALIGNED(
+        int64_t, uint64_t, cur_buf, cfg._cause_width, cfg._cause_offset);
+    if (!(valid || exception || cause)) {
+      continue;
+    }
+
+    uint64_t time = EXTRACT_ALIGNED(
+        int64_t, uint64_t, cur_buf, cfg._time_width, cfg._time_offset);
+    uint64_t iaddr = EXTRACT_ALIGNED(
+        int64_t, uint64_t, cur_buf, cfg._iaddr_width, cfg._iaddr_offset);
+    if (!keep(time, iaddr)) {
+      dropped++;
+      continue;
+    }
+
+    kept++;
+    if (out != cur_buf) {
+      memmove(out, cur_buf, bytes_per_trace);
+    }
+    out += bytes_per_trace;
+  }
+  return out - buf;
+}
@@ -0,0 +1,62 @@
+#ifndef __TRACE_SAMPLER_H__
+#define __TRACE_SAMPLER_H__
+
+#include "thread_pool.h"
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Host-side recording window for cospike trace mode.
+ *
+ * A committed record is kept only if it falls inside every configured
+ * window:
+ *  - cycle windows: [start, end) ranges over the record timestamp
+ *  - PC window: opens on a record at pc_start, closes after pc_end
+ *  - periodic sampling: the first N of every M records that pass the above
+ * Records without a valid instruction, exception or cause are always
+ * dropped since the printers skip them anyway.
+ */
+class trace_sampler_t {
+public:
+  trace_sampler_t(const trace_cfg_t &cfg) : cfg(cfg) {}
+
+  // parses "<start>:<end>[,<start>:<end>...]" (decimal cycles)
+  bool add_cycle_windows(const std::string &spec);
+  void set_pc_window(uint64_t pc_start, uint64_t pc_end);
+  // parses "<N>:<M>"
+  bool set_periodic(const std::string &spec);
+
+  bool enabled() const {
+    return !cycle_windows.empty() || pc_window || sample_period != 0;
+  }
+
+  // Compacts the kept records of buf to its front. Returns the bytes kept.
+  size_t filter(uint8_t *buf, size_t bytes);
+
+  uint64_t records_kept() const { return kept; }
+  uint64_t records_dropped() const { return dropped; }
+
+private:
+  bool keep(uint64_t time, uint64_t iaddr);
+
+  trace_cfg_t cfg;
+
+  std::vector<std::pair<uint64_t, uint64_t>> cycle_windows;
+  size_t cycle_idx = 0;
+
+  bool pc_window = false;
+  bool pc_active = false;
+  uint64_t pc_start = 0;
+  uint64_t pc_end = 0;
+
+  uint64_t sample_len = 0;
+  uint64_t sample_period = 0;
+  uint64_t sample_pos = 0;
+
+  uint64_t kept = 0;
+  uint64_t dropped = 0;
+};
+
+#endif //__TRACE_SAMPLER_H__
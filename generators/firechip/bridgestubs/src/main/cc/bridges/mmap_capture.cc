@@ -0,0 +1,91 @@
+// See LICENSE for license details
+
+#include "mmap_capture.h"
+
+#include <cinttypes>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The file is first sized to INITIAL_BYTES and then doubled, up to
+// MAX_GROWTH_BYTES at a time.
+#define INITIAL_BYTES (64UL << 20)
+#define MAX_GROWTH_BYTES (1UL << 30)
+
+mmap_capture_t::mmap_capture_t(const std::string &filename,
+                               const std::string &header)
+    : filename(filename) {
+  this->fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (this->fd < 0) {
+    fprintf(stderr, "Could not open capture file: %s\n", filename.c_str());
+    abort();
+  }
+
+  std::string idxname = filename + ".idx";
+  this->index = fopen(idxname.c_str(), "w");
+  if (!this->index) {
+    fprintf(stderr, "Could not open capture index: %s\n", idxname.c_str());
+    abort();
+  }
+  fputs(header.c_str(), this->index);
+
+  grow(INITIAL_BYTES);
+}
+
+mmap_capture_t::~mmap_capture_t() {
+  if (this->base) {
+    munmap(this->base, this->mapped);
+  }
+  // drop the unused, preallocated tail of the file
+  if (ftruncate(this->fd, this->cursor) != 0) {
+    perror("ftruncate");
+  }
+  close(this->fd);
+  fclose(this->index);
+}
+
+void mmap_capture_t::grow(size_t min_size) {
+  size_t new_size = this->mapped ? this->mapped : INITIAL_BYTES;
+  while (new_size < min_size) {
+    new_size += (new_size < MAX_GROWTH_BYTES) ? new_size : MAX_GROWTH_BYTES;
+  }
+
+  if (ftruncate(this->fd, new_size) != 0) {
+    perror("ftruncate");
+    abort();
+  }
+
+  void *p;
+  if (this->base) {
+    p = mremap(this->base, this->mapped, new_size, MREMAP_MAYMOVE);
+  } else {
+    p = mmap(
+        nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+  }
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Could not map capture file: %s\n", filename.c_str());
+    abort();
+  }
+  // captured data is written once and never read back by the simulator
+  madvise(p, new_size, MADV_SEQUENTIAL);
+
+  this->base = (uint8_t *)p;
+  this->mapped = new_size;
+}
+
+uint8_t *mmap_capture_t::reserve(size_t max_bytes) {
+  if (this->cursor + max_bytes > this->mapped) {
+    grow(this->cursor + max_bytes);
+  }
+  return this->base + this->cursor;
+}
+
+void mmap_capture_t::commit(size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  fprintf(this->index, "%" PRIu64 " %zu\n", this->cursor, bytes);
+  this->cursor += bytes;
+}
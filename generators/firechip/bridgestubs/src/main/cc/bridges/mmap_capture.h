@@ -0,0 +1,43 @@
+// See LICENSE for license details
+#ifndef __MMAP_CAPTURE_H
+#define __MMAP_CAPTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdio.h>
+#include <string>
+
+/**
+ * Raw, zero-copy capture of a to-host stream into a memory-mapped file.
+ *
+ * Bridges pull() straight into the pointer returned by reserve() and then
+ * commit() the number of bytes received. The data file grows on demand and
+ * is truncated to the captured length on close. A text index,
+ * <filename>.idx, starts with the caller-provided header and then records
+ * one "<offset> <bytes>" line per non-empty batch.
+ */
+class mmap_capture_t {
+public:
+  mmap_capture_t(const std::string &filename, const std::string &header);
+  ~mmap_capture_t();
+
+  // Returns a pointer with room for at least max_bytes, growing the file
+  // if required.
+  uint8_t *reserve(size_t max_bytes);
+  // Marks bytes at the pointer returned by the last reserve() as captured.
+  void commit(size_t bytes);
+
+  uint64_t bytes_captured() const { return cursor; }
+
+private:
+  void grow(size_t min_size);
+
+  std::string filename;
+  int fd;
+  FILE *index;
+  uint8_t *base = nullptr;
+  size_t mapped = 0;
+  uint64_t cursor = 0;
+};
+
+#endif // __MMAP_CAPTURE_H
@@ -1,6 +1,12 @@
 // See LICENSE for license details
 
 #include "tracerv.h"
+#include "bridges/mmap_capture.h"
+#include "bridges/tracerv/chunked_trace.h"
+#include "bridges/tracerv/serialize_pipeline.h"
+#include "bridges/tracerv/trace_filter.h"
+#include "bridges/tracerv/trace_format.h"
+#include "bridges/tracerv/trace_merger.h"
 #include "bridges/tracerv/trace_tracker.h"
 #include "bridges/tracerv/tracerv_processing.h"
 
@@ -23,6 +29,47 @@ char tracerv_t::KIND;
 // useful for iterating on software side only without re-running on FPGA.
 // #define FIREPERF_LOGGER
 
+namespace {
+// Appends the sign-extended address and cycle of every valid instruction in
+// a batch of tokens, in trace order
+void decode_retired(const uint64_t *const OUTBUF,
+                    const size_t bytes_received,
+                    const int max_core_ipc,
+                    std::vector<RetiredInstr> &out) {
+  const int max_consider = std::min(max_core_ipc, 7);
+  for (size_t i = 0; i < (bytes_received / sizeof(uint64_t)); i += 8) {
+    uint64_t cycle_internal = OUTBUF[i + 0];
+
+    for (int q = 0; q < max_consider; q++) {
+      if (OUTBUF[i + 1 + q] & tracerv_t::valid_mask) {
+        uint64_t iaddr =
+            (uint64_t)((((int64_t)(OUTBUF[i + 1 + q])) << 24) >> 24);
+        out.push_back({iaddr, cycle_internal});
+      }
+    }
+  }
+}
+
+// Clears the privilege level of every instruction, so that all output keeps
+// the {valid, iaddr} layout
+void strip_priv(uint64_t *const OUTBUF, const size_t bytes_received) {
+  for (size_t i = 0; i < (bytes_received / sizeof(uint64_t)); i += 8) {
+    for (int q = 0; q < 7; q++) {
+      OUTBUF[i + 1 + q] &= ~tracerv_t::priv_bits;
+    }
+  }
+}
+
+#ifdef FIREPERF_LOGGER
+void log_retired(FILE *tracefile, const std::vector<RetiredInstr> &retired) {
+  for (const auto &instr : retired) {
+    fprintf(tracefile, "%016" PRIx64, instr.iaddr);
+    fprintf(tracefile, "%016" PRIx64 "\n", instr.cycle);
+  }
+}
+#endif // FIREPERF_LOGGER
+} // namespace
+
 tracerv_t::tracerv_t(simif_t &sim,
                      StreamEngine &stream,
                      const TRACERVBRIDGEMODULE_struct &mmio_addrs,
@@ -31,10 +78,12 @@ tracerv_t::tracerv_t(simif_t &sim,
                      int stream_idx,
                      int stream_depth,
                      unsigned int max_core_ipc,
+                     bool priv_in_trace,
                      const ClockInfo &clock_info)
     : streaming_bridge_driver_t(sim, stream, &KIND), mmio_addrs(mmio_addrs),
       stream_idx(stream_idx), stream_depth(stream_depth),
-      max_core_ipc(max_core_ipc), clock_info(clock_info) {
+      max_core_ipc(max_core_ipc), priv_in_trace(priv_in_trace),
+      clock_info(clock_info) {
   const char *tracefilename = nullptr;
   const char *dwarf_file_name = nullptr;
   this->tracefile = nullptr;
@@ -57,6 +106,31 @@ tracerv_t::tracerv_t(simif_t &sim,
   const std::string humanreadable_arg = "+trace-humanreadable";
   const std::string trace_output_format_arg = "+trace-output-format=";
   const std::string dwarf_file_arg = "+dwarf-file-name=";
+  // Dumps raw tokens into an mmap'd file (plus a batch index) with no
+  // processing, for maximum trace bandwidth
+  const std::string rawcapture_arg = "+trace-raw-capture";
+  bool raw_capture = false;
+  // FirePerf only: aggregate cycles per call stack in memory and write
+  // folded stacks and a per-function table to files next to the tracefile
+  // at the end of simulation, instead of the start/end label log
+  const std::string fireperf_aggregate_arg = "+fireperf-aggregate";
+  bool fireperf_aggregate = false;
+  // Formats human-readable and binary traces on this many threads, off the
+  // simulation thread. FirePerf is always processed in order on tick().
+  const std::string tracethreads_arg = "+trace-threads=";
+  unsigned trace_threads = 0;
+  // Host-side filters applied to every instruction before it is written:
+  // hex PC ranges, symbol names looked up in +dwarf-file-name, and
+  // privilege levels (any of "usm")
+  const std::string filterpc_arg = "+trace-filter-pc=";
+  const std::string filtersymbols_arg = "+trace-filter-symbols=";
+  const std::string filterpriv_arg = "+trace-filter-priv=";
+  std::string filter_symbols;
+  trace_filter_t filter;
+  // Writes the traces of all bridges to one cycle-ordered file,
+  // <tracefile>-merged, instead of one file per bridge
+  const std::string merge_arg = "+trace-merge";
+  bool merge = false;
 
   for (auto &arg : args) {
     if (arg.find(tracefile_arg) == 0) {
@@ -101,9 +175,76 @@ tracerv_t::tracerv_t(simif_t &sim,
           const_cast<char *>(arg.c_str()) + dwarf_file_arg.length();
       this->dwarf_file_name = std::string(dwarf_file_name);
     }
+    if (arg.find(rawcapture_arg) == 0) {
+      raw_capture = true;
+    }
+    if (arg.find(fireperf_aggregate_arg) == 0) {
+      fireperf_aggregate = true;
+    }
+    if (arg.find(tracethreads_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + tracethreads_arg.length();
+      trace_threads = atoi(str);
+    }
+    if (arg.find(filterpc_arg) == 0) {
+      if (!filter.add_pc_ranges(arg.substr(filterpc_arg.length()))) {
+        fprintf(stderr, "Invalid +trace-filter-pc: %s\n", arg.c_str());
+        abort();
+      }
+    }
+    if (arg.find(filtersymbols_arg) == 0) {
+      filter_symbols = arg.substr(filtersymbols_arg.length());
+    }
+    if (arg.find(merge_arg) == 0) {
+      merge = true;
+    }
+    if (arg.find(filterpriv_arg) == 0) {
+      if (!filter.set_privileges(arg.substr(filterpriv_arg.length()))) {
+        fprintf(stderr, "Invalid +trace-filter-priv: %s\n", arg.c_str());
+        abort();
+      }
+    }
+  }
+
+  if (!filter_symbols.empty()) {
+    if (this->dwarf_file_name.empty()) {
+      fprintf(stderr,
+              "+trace-filter-symbols specified but no +dwarf-file-name "
+              "given\n");
+      abort();
+    }
+    for (const auto &name :
+         filter.add_symbols(filter_symbols, this->dwarf_file_name)) {
+      fprintf(stderr, "TracerV: filter symbol %s not found\n", name.c_str());
+    }
+  }
+  if (filter.filters_privilege() && !priv_in_trace) {
+    fprintf(stderr,
+            "+trace-filter-priv is not supported, the instruction addresses "
+            "leave no room for the privilege level in the trace\n");
+    abort();
+  }
+  if (filter.enabled()) {
+    this->filter = new trace_filter_t(filter);
   }
 
-  if (tracefilename) {
+  if (tracefilename && raw_capture) {
+    // the clock header goes into the index to keep the data file raw
+    std::string tfname = std::string(tracefilename) + std::string("-C") +
+                         std::to_string(tracerno);
+    this->capture = new mmap_capture_t(tfname, clock_info.file_header());
+  } else if (tracefilename && merge) {
+    if (outputfmtselect != 0 && outputfmtselect != 1) {
+      fprintf(stderr,
+              "+trace-merge supports +trace-output-format=0 or 1 only\n");
+      abort();
+    }
+    this->human_readable = (outputfmtselect == 0);
+    this->merger =
+        trace_merger_t::attach(std::string(tracefilename) + "-merged",
+                               clock_info.file_header(),
+                               this->human_readable);
+    this->merge_source = this->merger->add_source(tracerno, max_core_ipc);
+  } else if (tracefilename) {
     // giving no tracefilename means we will create NO tracefiles
     std::string tfname = std::string(tracefilename) + std::string("-C") +
                          std::to_string(tracerno);
@@ -112,7 +253,10 @@ tracerv_t::tracerv_t(simif_t &sim,
       fprintf(stderr, "Could not open Trace log file: %s\n", tracefilename);
       abort();
     }
-    write_header(tracefile);
+    // the chunked format carries the header inside its own file header
+    if (outputfmtselect != 3) {
+      write_header(tracefile);
+    }
 
     // This must be kept consistent with config_runtime.yaml's output_format.
     // That file's comments are the single source of truth for this.
@@ -125,6 +269,13 @@ tracerv_t::tracerv_t(simif_t &sim,
     } else if (outputfmtselect == 2) {
       this->human_readable = false;
       this->fireperf = true;
+    } else if (outputfmtselect == 3) {
+      this->human_readable = false;
+      this->fireperf = false;
+      this->chunked = new chunked_trace_writer_t(
+          this->tracefile,
+          clock_info.file_header(),
+          1 + std::min((int)this->max_core_ipc, 7));
     } else {
       fprintf(stderr, "Invalid trace format arg\n");
     }
@@ -141,15 +292,51 @@ tracerv_t::tracerv_t(simif_t &sim,
       fprintf(stderr, "+fireperf specified but no +dwarf-file-name given\n");
       abort();
     }
-    this->trace_tracker =
-        new TraceTracker(this->dwarf_file_name, this->tracefile);
+    this->trace_tracker = new TraceTracker(
+        this->dwarf_file_name, this->tracefile, fireperf_aggregate);
+    if (fireperf_aggregate) {
+      std::string prefix = std::string(tracefilename) + std::string("-C") +
+                           std::to_string(tracerno);
+      this->fireperf_folded_name = prefix + std::string("-folded.txt");
+      this->fireperf_table_name = prefix + std::string("-functions.csv");
+    }
+  } else if (this->tracefile && !this->chunked && trace_threads > 0) {
+    const int max_core_ipc = this->max_core_ipc;
+    const bool human_readable = this->human_readable;
+    const bool test_output = this->test_output;
+    auto formatter = [=](const uint64_t *OUTBUF,
+                         size_t bytes_received,
+                         std::vector<char> &out) {
+      format(OUTBUF,
+             bytes_received,
+             out,
+             max_core_ipc,
+             human_readable,
+             test_output);
+    };
+    // two slots per worker, so that one batch per worker can wait to be
+    // written while the workers move on
+    this->pipeline =
+        new serialize_pipeline_t(this->tracefile,
+                                 formatter,
+                                 trace_threads,
+                                 2 * trace_threads,
+                                 this->stream_depth * STREAM_WIDTH_BYTES);
   }
 }
 
 tracerv_t::~tracerv_t() {
+  // writes out any batches still in flight before the file is closed
+  delete this->pipeline;
+  // writes the chunk index
+  delete this->chunked;
+  delete this->filter;
+  // flushes any buffered labels before the file is closed
+  delete this->trace_tracker;
   if (this->tracefile) {
     fclose(this->tracefile);
   }
+  delete this->capture;
 }
 
 void tracerv_t::init() {
@@ -211,30 +398,67 @@ void tracerv_t::init() {
 size_t tracerv_t::process_tokens(int num_beats, int minimum_batch_beats) {
   size_t maximum_batch_bytes = num_beats * STREAM_WIDTH_BYTES;
   size_t minimum_batch_bytes = minimum_batch_beats * STREAM_WIDTH_BYTES;
-  // TODO. as opt can mmap file and just load directly into it.
+  if (this->capture) {
+    auto bytes_received = pull(this->stream_idx,
+                               this->capture->reserve(maximum_batch_bytes),
+                               maximum_batch_bytes,
+                               minimum_batch_bytes);
+    this->capture->commit(bytes_received);
+    return bytes_received;
+  }
+  if (this->pipeline) {
+    uint8_t *slot = this->pipeline->acquire();
+    const size_t bytes_received = pull(
+        this->stream_idx, slot, maximum_batch_bytes, minimum_batch_bytes);
+    size_t bytes_kept = bytes_received;
+    if (this->filter) {
+      bytes_kept =
+          this->filter->apply((uint64_t *)slot, bytes_received, max_core_ipc);
+    }
+    if (this->priv_in_trace) {
+      strip_priv((uint64_t *)slot, bytes_kept);
+    }
+    this->pipeline->submit(bytes_kept);
+    return bytes_received;
+  }
   page_aligned_sized_array(OUTBUF, this->stream_depth * STREAM_WIDTH_BYTES);
   auto bytes_received =
       pull(this->stream_idx, OUTBUF, maximum_batch_bytes, minimum_batch_bytes);
+  // the filter only changes what is written, callers still see every byte
+  // that was pulled off the stream
+  size_t bytes_kept = bytes_received;
+  if (this->filter) {
+    bytes_kept =
+        this->filter->apply((uint64_t *)OUTBUF, bytes_received, max_core_ipc);
+  }
+  if (this->priv_in_trace) {
+    strip_priv((uint64_t *)OUTBUF, bytes_kept);
+  }
   // check that a tracefile exists (one is enough) since the manager
   // does not create a tracefile when trace_enable is disabled, but the
   // TracerV bridge still exists, and no tracefile is created by default.
-  if (this->tracefile) {
-    std::function<void(uint64_t, uint64_t)> addInstruction = NULL;
-
-    if (fireperf) {
-      addInstruction = std::bind(&TraceTracker::addInstruction,
-                                 this->trace_tracker,
-                                 std::placeholders::_1,
-                                 std::placeholders::_2);
-    }
+  if (this->merger) {
+    this->merger->push(this->merge_source, (uint64_t *)OUTBUF, bytes_kept);
+  } else if (this->chunked) {
+    this->chunked->append((uint64_t *)OUTBUF, bytes_kept);
+  } else if (this->tracefile && fireperf && !test_output) {
+    // hand the whole batch to the tracker in one call
+    static thread_local std::vector<RetiredInstr> retired;
+    retired.clear();
+    decode_retired((uint64_t *)OUTBUF, bytes_kept, max_core_ipc, retired);
+#ifdef FIREPERF_LOGGER
+    log_retired(tracefile, retired);
+#endif // FIREPERF_LOGGER
+    this->trace_tracker->addInstructions(retired.data(), retired.size());
+  } else if (this->tracefile) {
     serialize((uint64_t *)OUTBUF,
-              bytes_received,
+              bytes_kept,
               tracefile,
-              addInstruction,
+              /*addInstruction=*/nullptr,
               max_core_ipc,
               human_readable,
               test_output,
-              fireperf);
+              /*fireperf=*/false);
   }
   return bytes_received;
 }
@@ -248,58 +472,75 @@ void tracerv_t::serialize(
     const bool human_readable,
     const bool test_output,
     const bool fireperf) {
-  const int max_consider = std::min(max_core_ipc, 7);
-  if (human_readable || test_output) {
-    for (size_t i = 0; i < (bytes_received / sizeof(uint64_t)); i += 8) {
-      if (test_output) {
-        fprintf(tracefile, "%016lx", OUTBUF[i + 7]);
-        fprintf(tracefile, "%016lx", OUTBUF[i + 6]);
-        fprintf(tracefile, "%016lx", OUTBUF[i + 5]);
-        fprintf(tracefile, "%016lx", OUTBUF[i + 4]);
-        fprintf(tracefile, "%016lx", OUTBUF[i + 3]);
-        fprintf(tracefile, "%016lx", OUTBUF[i + 2]);
-        fprintf(tracefile, "%016lx", OUTBUF[i + 1]);
-        fprintf(tracefile, "%016lx\n", OUTBUF[i + 0]);
-        // At least one valid instruction
-      } else {
-        for (int q = 0; q < max_consider; q++) {
-          if (OUTBUF[i + q + 1] & valid_mask) {
-            fprintf(tracefile,
-                    "Cycle: %016" PRId64 " I%d: %016" PRIx64 "\n",
-                    OUTBUF[i + 0],
-                    q,
-                    OUTBUF[i + q + 1] & (~valid_mask));
-          }
-        }
-      }
+  if (fireperf && !(human_readable || test_output)) {
+    std::vector<RetiredInstr> retired;
+    decode_retired(OUTBUF, bytes_received, max_core_ipc, retired);
+#ifdef FIREPERF_LOGGER
+    log_retired(tracefile, retired);
+#endif // FIREPERF_LOGGER
+    for (const auto &instr : retired) {
+      addInstruction(instr.iaddr, instr.cycle);
     }
-  } else if (fireperf) {
+  } else {
+    // reused across batches to avoid reallocating on every call
+    static thread_local std::vector<char> out;
+    out.clear();
+    format(OUTBUF,
+           bytes_received,
+           out,
+           max_core_ipc,
+           human_readable,
+           test_output);
+    fwrite(out.data(), 1, out.size(), tracefile);
+  }
+}
+
+void tracerv_t::format(const uint64_t *const OUTBUF,
+                       const size_t bytes_received,
+                       std::vector<char> &out,
+                       const int max_core_ipc,
+                       const bool human_readable,
+                       const bool test_output) {
+  const int max_consider = std::min(max_core_ipc, 7);
+  const size_t tokens = bytes_received / sizeof(uint64_t) / 8;
 
-    for (size_t i = 0; i < (bytes_received / sizeof(uint64_t)); i += 8) {
-      uint64_t cycle_internal = OUTBUF[i + 0];
+  // size the output for the worst case, then trim to what was written
+  size_t max_token_bytes;
+  if (test_output) {
+    max_token_bytes = TRACE_TEST_LINE_BYTES;
+  } else if (human_readable) {
+    max_token_bytes = max_consider * TRACE_HUMAN_LINE_BYTES;
+  } else {
+    max_token_bytes = (1 + max_consider) * sizeof(uint64_t);
+  }
+  const size_t start = out.size();
+  out.resize(start + tokens * max_token_bytes);
+  char *p = out.data() + start;
 
+  for (size_t i = 0; i < tokens * 8; i += 8) {
+    if (test_output) {
+      for (int q = 7; q >= 0; q--) {
+        p = put_hex16(p, OUTBUF[i + q]);
+      }
+      *p++ = '\n';
+    } else if (human_readable) {
       for (int q = 0; q < max_consider; q++) {
-        if (OUTBUF[i + 1 + q] & valid_mask) {
-          uint64_t iaddr =
-              (uint64_t)((((int64_t)(OUTBUF[i + 1 + q])) << 24) >> 24);
-          addInstruction(iaddr, cycle_internal);
-#ifdef FIREPERF_LOGGER
-          fprintf(tracefile, "%016llx", iaddr);
-          fprintf(tracefile, "%016llx\n", cycle_internal);
-#endif // FIREPERF_LOGGER
+        if (OUTBUF[i + q + 1] & valid_mask) {
+          p = put_human_line(p,
+                             OUTBUF[i + 0],
+                             q,
+                             OUTBUF[i + q + 1] & (~valid_mask));
         }
       }
-    }
-  } else {
-    for (size_t i = 0; i < (bytes_received / sizeof(uint64_t)); i += 8) {
+    } else {
       // this stores as raw binary. stored as little endian.
       // e.g. to get the same thing as the human readable above,
       // flip all the bytes in each 512-bit line.
-      for (int q = 0; q < 1 + max_consider; q++) {
-        fwrite(OUTBUF + (i + q), sizeof(uint64_t), 1, tracefile);
-      }
+      memcpy(p, OUTBUF + i, (1 + max_consider) * sizeof(uint64_t));
+      p += (1 + max_consider) * sizeof(uint64_t);
     }
   }
+  out.resize(p - out.data());
 }
 
 void tracerv_t::write_header(FILE *file) {
@@ -312,9 +553,53 @@ void tracerv_t::tick() {
   }
 }
 
+void tracerv_t::finish() {
+  flush();
+  if (this->merger) {
+    this->merger->finish_source(this->merge_source);
+  }
+  if (this->filter) {
+    printf("TracerV: host filter dropped %" PRIu64 " instructions\n",
+           this->filter->instructions_dropped());
+  }
+  if (this->pipeline) {
+    printf("TracerV: serialization stalled %" PRIu64
+           " times waiting for a free slot\n",
+           this->pipeline->producer_stall_events());
+  }
+  if (!this->fireperf_table_name.empty()) {
+    FILE *folded = fopen(this->fireperf_folded_name.c_str(), "w");
+    if (!folded) {
+      fprintf(stderr,
+              "Could not open FirePerf folded stacks: %s\n",
+              this->fireperf_folded_name.c_str());
+      abort();
+    }
+    FILE *table = fopen(this->fireperf_table_name.c_str(), "w");
+    if (!table) {
+      fprintf(stderr,
+              "Could not open FirePerf function table: %s\n",
+              this->fireperf_table_name.c_str());
+      abort();
+    }
+    this->trace_tracker->writeAggregate(folded, table);
+    fclose(folded);
+    fclose(table);
+  }
+}
+
 // Pull in any remaining tokens and flush them to file
 void tracerv_t::flush() {
   pull_flush(stream_idx);
   while (this->trace_enabled && (process_tokens(this->stream_depth, 0) > 0))
     ;
+  if (this->pipeline) {
+    this->pipeline->drain();
+  }
+  if (this->chunked) {
+    this->chunked->flush();
+  }
+  if (this->trace_tracker) {
+    this->trace_tracker->flush();
+  }
 }
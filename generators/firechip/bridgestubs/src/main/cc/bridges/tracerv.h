@@ -5,10 +5,16 @@
 #include "core/bridge_driver.h"
 #include "core/clock_info.h"
 #include <functional>
+#include <memory>
 #include <vector>
 
 class TraceTracker;
 class ObjdumpedBinary;
+class mmap_capture_t;
+class serialize_pipeline_t;
+class chunked_trace_writer_t;
+class trace_filter_t;
+class trace_merger_t;
 
 struct TRACERVBRIDGEMODULE_struct {
   uint64_t initDone;
@@ -41,12 +47,13 @@ public:
             int stream_idx,
             int stream_depth,
             unsigned int max_core_ipc,
+            bool priv_in_trace,
             const ClockInfo &clock_info);
   ~tracerv_t();
 
   virtual void init();
   virtual void tick();
-  virtual void finish() { flush(); };
+  virtual void finish();
 
   static void serialize(const uint64_t *OUTBUF,
                         size_t bytes_received,
@@ -56,6 +63,14 @@ public:
                         bool human_readable,
                         bool test_output,
                         bool fireperf);
+  // Same output as serialize() for the human-readable, test and binary
+  // formats, appended to out
+  static void format(const uint64_t *OUTBUF,
+                     size_t bytes_received,
+                     std::vector<char> &out,
+                     int max_core_ipc,
+                     bool human_readable,
+                     bool test_output);
   void write_header(FILE *file);
 
 private:
@@ -67,8 +82,22 @@ public:
   const int max_core_ipc;
 
 private:
+  // Set if the bridge packs the privilege level into each instruction word
+  const bool priv_in_trace;
   ClockInfo clock_info;
   FILE *tracefile;
+  // Set in raw capture mode, where tokens are pulled straight into an
+  // mmap'd file instead of tracefile
+  mmap_capture_t *capture = nullptr;
+  // Set when +trace-threads is given and batches are formatted off-thread
+  serialize_pipeline_t *pipeline = nullptr;
+  // Set for the compressed, seekable output format
+  chunked_trace_writer_t *chunked = nullptr;
+  // Set when any +trace-filter-* rule is given
+  trace_filter_t *filter = nullptr;
+  // Set with +trace-merge, shared by every merging bridge
+  std::shared_ptr<trace_merger_t> merger;
+  size_t merge_source = 0;
 
 public:
   uint64_t cur_cycle;
@@ -84,7 +113,7 @@ public:
 private:
   // TODO: rename this from linuxbin
   ObjdumpedBinary *linuxbin;
-  TraceTracker *trace_tracker;
+  TraceTracker *trace_tracker = nullptr;
 
   bool human_readable = false;
   // If no filename is provided, the instruction trace is not collected
@@ -97,6 +126,9 @@ private:
   std::string tracefilename;
   std::string dwarf_file_name;
   bool fireperf = false;
+  // set when FirePerf aggregates in memory, see +fireperf-aggregate
+  std::string fireperf_folded_name;
+  std::string fireperf_table_name;
 
   size_t process_tokens(int num_beats, int minium_batch_beats);
   int beats_available_stable();
@@ -104,6 +136,10 @@ private:
 public:
   void flush();
   static constexpr uint64_t valid_mask = (1ULL << 63); // valid bit is 64th bit
+  // followed, if priv_in_trace, by the 3-bit privilege level, and then the
+  // address. The privilege bits are cleared before anything is written out.
+  static constexpr int priv_shift = 60;
+  static constexpr uint64_t priv_bits = (7ULL << priv_shift);
 };
 
 #endif // __TRACERV_H
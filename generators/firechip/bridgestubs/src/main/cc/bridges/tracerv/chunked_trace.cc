@@ -0,0 +1,172 @@
+#include "chunked_trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <zlib.h>
+
+using namespace chunked_trace;
+
+// uncompressed bytes of records per chunk
+#define CHUNK_BYTES (1 << 20)
+// favour speed, the writer runs on the simulation thread
+#define COMPRESSION_LEVEL 1
+
+chunked_trace_writer_t::chunked_trace_writer_t(FILE *file,
+                                               const std::string &clock_header,
+                                               uint32_t words_per_record)
+    : file(file), words_per_record(words_per_record) {
+  file_header_t header = {};
+  memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+  header.version = VERSION;
+  header.words_per_record = words_per_record;
+  header.clock_header_bytes = clock_header.size();
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(clock_header.data(), 1, clock_header.size(), file);
+  this->offset = sizeof(header) + clock_header.size();
+
+  records.reserve(CHUNK_BYTES / sizeof(uint64_t) + 8);
+}
+
+chunked_trace_writer_t::~chunked_trace_writer_t() {
+  flush();
+
+  chunk_trailer_t trailer;
+  trailer.index_offset = this->offset;
+  trailer.chunks = index.size();
+  memcpy(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic));
+  fwrite(index.data(), sizeof(chunk_index_t), index.size(), file);
+  fwrite(&trailer, sizeof(trailer), 1, file);
+}
+
+void chunked_trace_writer_t::append(const uint64_t *tokens, size_t bytes) {
+  for (size_t i = 0; i < (bytes / sizeof(uint64_t)); i += 8) {
+    records.insert(records.end(), tokens + i, tokens + i + words_per_record);
+    if (records.size() * sizeof(uint64_t) >= CHUNK_BYTES) {
+      flush();
+    }
+  }
+}
+
+void chunked_trace_writer_t::flush() {
+  if (records.empty()) {
+    return;
+  }
+
+  const uLong raw_bytes = records.size() * sizeof(uint64_t);
+  uLongf compressed_bytes = compressBound(raw_bytes);
+  compressed.resize(compressed_bytes);
+  if (compress2(compressed.data(),
+                &compressed_bytes,
+                (const Bytef *)records.data(),
+                raw_bytes,
+                COMPRESSION_LEVEL) != Z_OK) {
+    fprintf(stderr, "TracerV: could not compress trace chunk\n");
+    abort();
+  }
+
+  chunk_header_t header;
+  header.start_cycle = records.front();
+  header.end_cycle = records[records.size() - words_per_record];
+  header.records = records.size() / words_per_record;
+  header.compressed_bytes = compressed_bytes;
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(compressed.data(), 1, compressed_bytes, file);
+
+  index.push_back(
+      {header.start_cycle, header.end_cycle, this->offset, header.records});
+  this->offset += sizeof(header) + compressed_bytes;
+  records.clear();
+}
+
+chunked_trace_reader_t::chunked_trace_reader_t(const std::string &filename) {
+  this->file = fopen(filename.c_str(), "rb");
+  if (!this->file) {
+    fprintf(stderr, "Could not open chunked trace: %s\n", filename.c_str());
+    abort();
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != VERSION || header.words_per_record == 0) {
+    fprintf(stderr, "Not a chunked TracerV trace: %s\n", filename.c_str());
+    abort();
+  }
+  clock_header_text.resize(header.clock_header_bytes);
+  if (fread(&clock_header_text[0], 1, header.clock_header_bytes, file) !=
+      header.clock_header_bytes) {
+    fprintf(stderr, "Truncated chunked trace: %s\n", filename.c_str());
+    abort();
+  }
+
+  chunk_trailer_t trailer;
+  if (fseek(file, -(long)sizeof(trailer), SEEK_END) != 0 ||
+      fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+      memcmp(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic)) != 0) {
+    fprintf(stderr,
+            "Chunked trace has no index, was the simulation cut short? %s\n",
+            filename.c_str());
+    abort();
+  }
+  index.resize(trailer.chunks);
+  if (fseek(file, trailer.index_offset, SEEK_SET) != 0 ||
+      fread(index.data(), sizeof(chunk_index_t), index.size(), file) !=
+          index.size()) {
+    fprintf(stderr, "Truncated chunked trace index: %s\n", filename.c_str());
+    abort();
+  }
+}
+
+chunked_trace_reader_t::~chunked_trace_reader_t() { fclose(this->file); }
+
+void chunked_trace_reader_t::read_chunk(size_t i, std::vector<uint64_t> &out) {
+  chunk_header_t chunk;
+  if (fseek(file, index[i].offset, SEEK_SET) != 0 ||
+      fread(&chunk, sizeof(chunk), 1, file) != 1) {
+    fprintf(stderr, "Could not read trace chunk %zu\n", i);
+    abort();
+  }
+  compressed.resize(chunk.compressed_bytes);
+  if (fread(compressed.data(), 1, chunk.compressed_bytes, file) !=
+      chunk.compressed_bytes) {
+    fprintf(stderr, "Truncated trace chunk %zu\n", i);
+    abort();
+  }
+
+  out.resize((size_t)chunk.records * header.words_per_record);
+  uLongf raw_bytes = out.size() * sizeof(uint64_t);
+  if (uncompress((Bytef *)out.data(),
+                 &raw_bytes,
+                 compressed.data(),
+                 chunk.compressed_bytes) != Z_OK ||
+      raw_bytes != out.size() * sizeof(uint64_t)) {
+    fprintf(stderr, "Corrupt trace chunk %zu\n", i);
+    abort();
+  }
+}
+
+void chunked_trace_reader_t::extract(uint64_t start_cycle,
+                                     uint64_t end_cycle,
+                                     std::vector<uint64_t> &out) {
+  out.clear();
+  const size_t words = header.words_per_record;
+
+  // chunks are in cycle order, skip those that end before the range
+  auto first = std::lower_bound(index.begin(),
+                                index.end(),
+                                start_cycle,
+                                [](const chunk_index_t &c, uint64_t cycle) {
+                                  return c.end_cycle < cycle;
+                                });
+
+  std::vector<uint64_t> chunk;
+  for (auto it = first; it != index.end() && it->start_cycle < end_cycle;
+       ++it) {
+    read_chunk(it - index.begin(), chunk);
+    for (size_t i = 0; i < chunk.size(); i += words) {
+      if (chunk[i] >= start_cycle && chunk[i] < end_cycle) {
+        out.insert(out.end(), chunk.begin() + i, chunk.begin() + i + words);
+      }
+    }
+  }
+}
@@ -0,0 +1,114 @@
+#ifndef __CHUNKED_TRACE_H
+#define __CHUNKED_TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * Compressed, seekable TracerV trace format (+trace-output-format=3).
+ *
+ * Records have the same layout as the raw binary format: the cycle
+ * followed by one word per traced lane, little endian. Records are grouped
+ * into independently deflated chunks so that a reader can jump straight to
+ * a cycle range.
+ *
+ *   file header   magic "TRVCHUNK", version, words per record, clock header
+ *   chunks        chunk_header_t followed by the compressed records
+ *   index         one chunk_index_t per chunk
+ *   trailer       chunk_trailer_t, at the very end of the file
+ */
+namespace chunked_trace {
+
+constexpr char FILE_MAGIC[8] = {'T', 'R', 'V', 'C', 'H', 'U', 'N', 'K'};
+constexpr char INDEX_MAGIC[8] = {'T', 'R', 'V', 'I', 'N', 'D', 'E', 'X'};
+constexpr uint32_t VERSION = 1;
+
+struct file_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t words_per_record;
+  // length of the clock header text that follows
+  uint32_t clock_header_bytes;
+  uint32_t reserved;
+};
+
+struct chunk_header_t {
+  uint64_t start_cycle;
+  uint64_t end_cycle;
+  uint32_t records;
+  uint32_t compressed_bytes;
+};
+
+struct chunk_index_t {
+  uint64_t start_cycle;
+  uint64_t end_cycle;
+  // offset of the chunk_header_t
+  uint64_t offset;
+  uint64_t records;
+};
+
+struct chunk_trailer_t {
+  uint64_t index_offset;
+  uint64_t chunks;
+  char magic[8];
+};
+
+} // namespace chunked_trace
+
+class chunked_trace_writer_t {
+public:
+  // Writes the file header to file, which must be empty and stays owned by
+  // the caller
+  chunked_trace_writer_t(FILE *file,
+                         const std::string &clock_header,
+                         uint32_t words_per_record);
+  // Writes out the last chunk and the index
+  ~chunked_trace_writer_t();
+
+  // Appends whole 512-bit tokens, keeping the first words_per_record words
+  // of each
+  void append(const uint64_t *tokens, size_t bytes);
+  // Compresses and writes any buffered records as a (possibly short) chunk
+  void flush();
+
+private:
+  FILE *file;
+  const uint32_t words_per_record;
+  uint64_t offset;
+
+  std::vector<uint64_t> records;
+  std::vector<uint8_t> compressed;
+  std::vector<chunked_trace::chunk_index_t> index;
+};
+
+class chunked_trace_reader_t {
+public:
+  // Aborts if filename is not a complete chunked trace
+  chunked_trace_reader_t(const std::string &filename);
+  ~chunked_trace_reader_t();
+
+  uint32_t words_per_record() const { return header.words_per_record; }
+  const std::string &clock_header() const { return clock_header_text; }
+  const std::vector<chunked_trace::chunk_index_t> &chunks() const {
+    return index;
+  }
+
+  // Replaces out with the records of chunk i
+  void read_chunk(size_t i, std::vector<uint64_t> &out);
+  // Replaces out with every record whose cycle is in [start_cycle,
+  // end_cycle), decompressing only the chunks that overlap the range
+  void extract(uint64_t start_cycle,
+               uint64_t end_cycle,
+               std::vector<uint64_t> &out);
+
+private:
+  FILE *file;
+  chunked_trace::file_header_t header;
+  std::string clock_header_text;
+  std::vector<chunked_trace::chunk_index_t> index;
+  std::vector<uint8_t> compressed;
+};
+
+#endif // __CHUNKED_TRACE_H
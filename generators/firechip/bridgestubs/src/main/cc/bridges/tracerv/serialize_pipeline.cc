@@ -0,0 +1,120 @@
+#include "serialize_pipeline.h"
+
+#include <cstdlib>
+
+// slot buffers are DMA targets, keep them page aligned
+#define SLOT_ALIGN 4096
+
+serialize_pipeline_t::serialize_pipeline_t(FILE *file,
+                                           formatter_t formatter,
+                                           unsigned num_workers,
+                                           unsigned num_slots,
+                                           size_t slot_bytes)
+    : file(file), formatter(formatter), slots(num_slots) {
+  const size_t alloc_bytes =
+      (slot_bytes + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+  for (auto &slot : slots) {
+    slot.data = (uint8_t *)aligned_alloc(SLOT_ALIGN, alloc_bytes);
+    if (!slot.data) {
+      fprintf(stderr, "Could not allocate trace serialization buffers\n");
+      abort();
+    }
+    slot.bytes = 0;
+    slot.state = slot_state::free;
+  }
+
+  for (unsigned i = 0; i < num_workers; i++) {
+    workers.emplace_back(&serialize_pipeline_t::work, this);
+  }
+  writer = std::thread(&serialize_pipeline_t::write, this);
+}
+
+serialize_pipeline_t::~serialize_pipeline_t() {
+  drain();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    terminate = true;
+  }
+  work_cv.notify_all();
+  write_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  writer.join();
+
+  for (auto &slot : slots) {
+    free(slot.data);
+  }
+}
+
+uint8_t *serialize_pipeline_t::acquire() {
+  std::unique_lock<std::mutex> lock(mutex);
+  slot_t &slot = slots[fill_head];
+  if (slot.state != slot_state::free) {
+    stall_events++;
+    free_cv.wait(lock, [&] { return slot.state == slot_state::free; });
+  }
+  return slot.data;
+}
+
+void serialize_pipeline_t::submit(size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    slots[fill_head].bytes = bytes;
+    slots[fill_head].state = slot_state::queued;
+    queued.push_back(fill_head);
+    in_flight++;
+    fill_head = (fill_head + 1) % slots.size();
+  }
+  work_cv.notify_one();
+}
+
+void serialize_pipeline_t::drain() {
+  std::unique_lock<std::mutex> lock(mutex);
+  free_cv.wait(lock, [&] { return in_flight == 0; });
+}
+
+void serialize_pipeline_t::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    work_cv.wait(lock, [&] { return terminate || !queued.empty(); });
+    if (queued.empty()) {
+      return;
+    }
+    slot_t &slot = slots[queued.front()];
+    queued.pop_front();
+
+    lock.unlock();
+    slot.out.clear();
+    formatter((const uint64_t *)slot.data, slot.bytes, slot.out);
+    lock.lock();
+
+    slot.state = slot_state::formatted;
+    write_cv.notify_one();
+  }
+}
+
+void serialize_pipeline_t::write() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    write_cv.wait(lock, [&] {
+      return terminate || slots[write_head].state == slot_state::formatted;
+    });
+    if (slots[write_head].state != slot_state::formatted) {
+      return;
+    }
+    slot_t &slot = slots[write_head];
+
+    lock.unlock();
+    fwrite(slot.out.data(), 1, slot.out.size(), file);
+    lock.lock();
+
+    slot.state = slot_state::free;
+    write_head = (write_head + 1) % slots.size();
+    in_flight--;
+    free_cv.notify_all();
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef __SERIALIZE_PIPELINE_H
+#define __SERIALIZE_PIPELINE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Formats pulled trace batches on a pool of worker threads and writes the
+ * results to a single file in the order the batches were submitted.
+ *
+ * Batches live in a fixed ring of page-aligned slots. The producer fills
+ * the slot returned by acquire() and hands it over with submit(); acquire()
+ * only blocks once every slot is queued, being formatted, or waiting to be
+ * written.
+ */
+class serialize_pipeline_t {
+public:
+  // Appends the formatted form of a batch of tokens to out
+  using formatter_t =
+      std::function<void(const uint64_t *, size_t, std::vector<char> &)>;
+
+  serialize_pipeline_t(FILE *file,
+                       formatter_t formatter,
+                       unsigned num_workers,
+                       unsigned num_slots,
+                       size_t slot_bytes);
+  ~serialize_pipeline_t();
+
+  // Returns a buffer of slot_bytes to pull the next batch into
+  uint8_t *acquire();
+  // Queues bytes of the acquired buffer. Submitting zero bytes keeps the
+  // buffer for the next acquire().
+  void submit(size_t bytes);
+  // Blocks until every submitted batch has been written out
+  void drain();
+
+  // Times acquire() had to wait for a slot, reported at finish
+  uint64_t producer_stall_events() const { return stall_events; }
+
+private:
+  enum class slot_state { free, queued, formatted };
+  struct slot_t {
+    uint8_t *data;
+    size_t bytes;
+    std::vector<char> out;
+    slot_state state;
+  };
+
+  void work();
+  void write();
+
+  FILE *file;
+  formatter_t formatter;
+  std::vector<slot_t> slots;
+  // next slot to fill, and next slot to write
+  size_t fill_head = 0;
+  size_t write_head = 0;
+  // slots in submission order that have not been picked up by a worker
+  std::deque<size_t> queued;
+  // slots submitted but not yet written
+  size_t in_flight = 0;
+
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::condition_variable write_cv;
+  std::condition_variable free_cv;
+  bool terminate = false;
+
+  std::vector<std::thread> workers;
+  std::thread writer;
+
+  uint64_t stall_events = 0;
+};
+
+#endif // __SERIALIZE_PIPELINE_H
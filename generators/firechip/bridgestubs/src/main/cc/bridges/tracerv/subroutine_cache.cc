@@ -0,0 +1,172 @@
+#include "subroutine_cache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+// the last character is the format version, bump it when the layout or
+// the parser's output changes
+const char CACHE_MAGIC[8] = {'T', 'R', 'V', 'S', 'U', 'B', 'R', '2'};
+
+std::string cache_dir() {
+  const char *dir = getenv("TRACERV_DWARF_CACHE");
+  if (dir != nullptr && dir[0] != '\0') {
+    return dir;
+  }
+  const char *home = getenv("HOME");
+  if (home == nullptr) {
+    return "";
+  }
+  return std::string(home) + "/.cache/tracerv";
+}
+
+// the size is part of the name so that a binary and its stripped copy
+// never evict each other
+std::string cache_path(const std::string &dir,
+                       const subroutine_cache_key_t &key) {
+  return dir + "/" + key.build_id + "-" + std::to_string(key.size);
+}
+
+// mkdir -p
+bool make_dirs(const std::string &path) {
+  for (size_t pos = 1; pos <= path.size(); pos++) {
+    if (pos == path.size() || path[pos] == '/') {
+      std::string prefix = path.substr(0, pos);
+      if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void put_u64(FILE *f, uint64_t val) { fwrite(&val, sizeof(val), 1, f); }
+
+void put_str(FILE *f, const std::string &str) {
+  uint32_t len = str.size();
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(str.data(), 1, len, f);
+}
+
+bool get_u64(FILE *f, uint64_t &val) {
+  return fread(&val, sizeof(val), 1, f) == 1;
+}
+
+bool get_str(FILE *f, std::string &str) {
+  uint32_t len;
+  if (fread(&len, sizeof(len), 1, f) != 1) {
+    return false;
+  }
+  str.resize(len);
+  return len == 0 || fread(&str[0], 1, len, f) == len;
+}
+} // namespace
+
+bool subroutine_cache_load(const subroutine_cache_key_t &key,
+                           subroutine_map &table,
+                           std::pair<uint64_t, uint64_t> &bounds) {
+  std::string dir = cache_dir();
+  if (dir.empty()) {
+    return false;
+  }
+  std::string path = cache_path(dir, key);
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    return false;
+  }
+
+  char magic[sizeof(CACHE_MAGIC)];
+  uint64_t size, mtime, count;
+  bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+            memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0 &&
+            get_u64(f, size) && get_u64(f, mtime);
+  // an older format or a rebuilt binary is a miss, not an error
+  if (!ok || size != key.size || mtime != key.mtime) {
+    fclose(f);
+    return false;
+  }
+  ok = get_u64(f, bounds.first) && get_u64(f, bounds.second) &&
+       get_u64(f, count);
+
+  subroutine_map loaded;
+  for (uint64_t i = 0; ok && i < count; i++) {
+    uint64_t pc_low, pc_end, function, sites;
+    std::string name;
+    ok = get_u64(f, pc_low) && get_u64(f, pc_end) && get_u64(f, function) &&
+         get_str(f, name) && get_u64(f, sites);
+    if (!ok) {
+      break;
+    }
+    auto iter = loaded.emplace_hint(
+        loaded.end(),
+        pc_low,
+        subroutine_t(name.c_str(), pc_end, function != 0));
+    for (uint64_t s = 0; ok && s < sites; s++) {
+      uint64_t pc;
+      ok = get_u64(f, pc) && get_str(f, name);
+      if (ok) {
+        iter->second.callsites.emplace_back(pc);
+        iter->second.callsites.back().name = name;
+      }
+    }
+  }
+  fclose(f);
+
+  if (!ok) {
+    fprintf(stderr, "Ignoring corrupt subroutine cache: %s\n", path.c_str());
+    return false;
+  }
+  printf("Loaded %zu subroutines from cache %s\n",
+         loaded.size(),
+         path.c_str());
+  table.swap(loaded);
+  return true;
+}
+
+void subroutine_cache_store(const subroutine_cache_key_t &key,
+                            const subroutine_map &table,
+                            const std::pair<uint64_t, uint64_t> &bounds) {
+  std::string dir = cache_dir();
+  if (dir.empty() || !make_dirs(dir)) {
+    fprintf(stderr, "Could not create subroutine cache directory\n");
+    return;
+  }
+  // written under a private name and renamed into place, so that
+  // concurrent simulations never read a partial file
+  std::string path = cache_path(dir, key);
+  std::string tmp = path + ".tmp" + std::to_string(getpid());
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "Could not write subroutine cache: %s\n", tmp.c_str());
+    return;
+  }
+
+  fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC), 1, f);
+  put_u64(f, key.size);
+  put_u64(f, key.mtime);
+  put_u64(f, bounds.first);
+  put_u64(f, bounds.second);
+  put_u64(f, table.size());
+  for (const auto &kv : table) {
+    put_u64(f, kv.first);
+    put_u64(f, kv.second.pc_end);
+    put_u64(f, kv.second.function);
+    put_str(f, kv.second.name);
+    put_u64(f, kv.second.callsites.size());
+    for (const callsite_t &site : kv.second.callsites) {
+      put_u64(f, site.pc);
+      put_str(f, site.name);
+    }
+  }
+
+  bool ok = !ferror(f);
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Could not write subroutine cache: %s\n", path.c_str());
+    unlink(tmp.c_str());
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef __SUBROUTINE_CACHE_H
+#define __SUBROUTINE_CACHE_H
+
+#include "tracerv_dwarf.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// On-disk cache of elf_t::subroutines() results, keyed by ELF build-id.
+// Files live in $TRACERV_DWARF_CACHE, or $HOME/.cache/tracerv if unset.
+
+// A build-id is shared by a binary and its stripped or objcopy'd
+// derivatives, so entries also record the size and mtime of the file
+struct subroutine_cache_key_t {
+  std::string build_id;
+  uint64_t size;
+  uint64_t mtime;
+};
+
+// Returns true and fills table and bounds on a cache hit
+bool subroutine_cache_load(const subroutine_cache_key_t &key,
+                           subroutine_map &table,
+                           std::pair<uint64_t, uint64_t> &bounds);
+// Best effort, failures only print a warning
+void subroutine_cache_store(const subroutine_cache_key_t &key,
+                            const subroutine_map &table,
+                            const std::pair<uint64_t, uint64_t> &bounds);
+
+#endif // __SUBROUTINE_CACHE_H
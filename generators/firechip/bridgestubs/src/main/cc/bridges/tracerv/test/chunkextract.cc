@@ -0,0 +1,37 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "../chunked_trace.h"
+
+// Prints the records of a chunked trace (+trace-output-format=3) in the
+// human-readable TracerV format, optionally limited to [start, end) cycles
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <trace> [start-cycle end-cycle]"
+              << std::endl;
+    return 1;
+  }
+
+  chunked_trace_reader_t reader(argv[1]);
+  uint64_t start = (argc > 2) ? strtoull(argv[2], nullptr, 10) : 0;
+  uint64_t end = (argc > 3) ? strtoull(argv[3], nullptr, 10) : UINT64_MAX;
+
+  std::vector<uint64_t> records;
+  reader.extract(start, end, records);
+
+  const uint32_t words = reader.words_per_record();
+  const uint64_t valid_mask = (1ULL << 63);
+  for (size_t i = 0; i < records.size(); i += words) {
+    for (uint32_t q = 0; q + 1 < words; q++) {
+      if (records[i + q + 1] & valid_mask) {
+        printf("Cycle: %016" PRId64 " I%d: %016" PRIx64 "\n",
+               records[i],
+               q,
+               records[i + q + 1] & (~valid_mask));
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include "../trace_merger.h"
+
+// Merges sources that produce tokens at different rates, one of which goes
+// idle long enough for the others' rings to fill, and checks that every
+// token is written exactly once
+int main(int argc, char *argv[]) {
+  const char *filename = (argc > 1) ? argv[1] : "mergetest.out";
+  const uint64_t valid_mask = (1ULL << 63);
+  const int num_sources = 3;
+  // tokens per cycle, source 2 stops after its first few tokens
+  const uint64_t period[num_sources] = {1, 3, 7};
+  const uint64_t idle_after = 16;
+  const uint64_t cycles = 200000;
+
+  std::map<uint64_t, int> expected;
+  {
+    trace_merger_t merger(filename, "", false);
+    size_t sources[num_sources];
+    for (int s = 0; s < num_sources; s++) {
+      sources[s] = merger.add_source(s, 1);
+    }
+    for (uint64_t cycle = 0; cycle < cycles; cycle++) {
+      for (int s = 0; s < num_sources; s++) {
+        if (cycle % period[s] || (s == 2 && cycle >= idle_after)) {
+          continue;
+        }
+        uint64_t token[8] = {cycle, valid_mask | ((uint64_t)s << 32) | cycle};
+        merger.push(sources[s], token, sizeof(token));
+        expected[token[1] & ~valid_mask] = 0;
+      }
+    }
+    for (int s = 0; s < num_sources; s++) {
+      merger.finish_source(sources[s]);
+    }
+  }
+
+  FILE *f = fopen(filename, "rb");
+  if (f == nullptr) {
+    perror("fopen");
+    return 1;
+  }
+  // core ID, cycle and one instruction per record
+  uint64_t record[3];
+  int errors = 0;
+  while (fread(record, sizeof(record), 1, f) == 1) {
+    uint64_t payload = record[2] & ~valid_mask;
+    auto it = expected.find(payload);
+    if (it == expected.end() || record[0] != (payload >> 32) ||
+        record[1] != (payload & 0xffffffff)) {
+      fprintf(stderr, "unexpected record at cycle %" PRIu64 "\n", record[1]);
+      errors++;
+    } else if (it->second++) {
+      fprintf(stderr,
+              "core %" PRIu64 " cycle %" PRIu64 " written twice\n",
+              record[0],
+              record[1]);
+      errors++;
+    }
+  }
+  fclose(f);
+
+  for (const auto &kv : expected) {
+    if (!kv.second) {
+      fprintf(stderr,
+              "core %" PRIu64 " cycle %" PRIu64 " missing\n",
+              kv.first >> 32,
+              kv.first & 0xffffffff);
+      errors++;
+    }
+  }
+  printf("%s: %zu tokens, %d errors\n",
+         errors ? "FAIL" : "PASS",
+         expected.size(),
+         errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+#include "trace_filter.h"
+#include "bridges/tracerv.h"
+#include "tracerv_elf.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+// Sorts ranges and merges any that overlap, so that a lookup only has to
+// check the last range starting at or below an address
+void normalize(std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  std::sort(ranges.begin(), ranges.end());
+  size_t out = 0;
+  for (size_t i = 1; i < ranges.size(); i++) {
+    if (ranges[i].first <= ranges[out].second) {
+      ranges[out].second = std::max(ranges[out].second, ranges[i].second);
+    } else {
+      ranges[++out] = ranges[i];
+    }
+  }
+  if (!ranges.empty()) {
+    ranges.resize(out + 1);
+  }
+}
+} // namespace
+
+bool trace_filter_t::add_pc_ranges(const std::string &spec) {
+  const char *str = spec.c_str();
+  while (*str) {
+    char *end;
+    uint64_t lo = strtoull(str, &end, 16);
+    if (*end != '-') {
+      return false;
+    }
+    uint64_t hi = strtoull(end + 1, &end, 16);
+    if (hi <= lo || (*end != ',' && *end != '\0')) {
+      return false;
+    }
+    pc_ranges.emplace_back(lo, hi);
+    str = (*end == ',') ? end + 1 : end;
+  }
+  normalize(pc_ranges);
+  return true;
+}
+
+std::vector<std::string>
+trace_filter_t::add_symbols(const std::string &spec,
+                            const std::string &binary_with_dwarf) {
+  std::vector<std::string> names;
+  size_t pos = 0;
+  while (pos <= spec.size()) {
+    size_t comma = spec.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = spec.size();
+    }
+    if (comma > pos) {
+      names.push_back(spec.substr(pos, comma - pos));
+    }
+    pos = comma + 1;
+  }
+
+  int fd = open(binary_with_dwarf.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return names;
+  }
+  subroutine_map table;
+  {
+    elf_t elf(fd);
+    elf.subroutines(table);
+  }
+  close(fd);
+
+  std::vector<std::string> missing;
+  for (const auto &name : names) {
+    bool found = false;
+    for (auto it = table.begin(); it != table.end(); ++it) {
+      if (it->second.name != name) {
+        continue;
+      }
+      // subroutines without an end run up to the next one
+      uint64_t end = it->second.pc_end;
+      if (end <= it->first) {
+        auto next = std::next(it);
+        end = (next != table.end()) ? next->first : it->first + 1;
+      }
+      pc_ranges.emplace_back(it->first, end);
+      found = true;
+    }
+    if (!found) {
+      missing.push_back(name);
+    }
+  }
+  normalize(pc_ranges);
+  return missing;
+}
+
+bool trace_filter_t::set_privileges(const std::string &spec) {
+  for (char c : spec) {
+    switch (c) {
+    case 'u':
+      priv_mask |= 1 << 0;
+      break;
+    case 's':
+      priv_mask |= 1 << 1;
+      break;
+    case 'm':
+      priv_mask |= 1 << 3;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+bool trace_filter_t::keep(uint64_t word) const {
+  if (priv_mask) {
+    // the top priv bit flags debug mode, filter on the privilege level
+    uint32_t priv = (word >> tracerv_t::priv_shift) & 0x3;
+    if (!(priv_mask & (1 << priv))) {
+      return false;
+    }
+  }
+
+  if (!pc_ranges.empty()) {
+    // sign-extend from 40 bits, as FirePerf does, to match symbol addresses
+    uint64_t iaddr = (uint64_t)((((int64_t)word) << 24) >> 24);
+    auto it = std::upper_bound(pc_ranges.begin(),
+                               pc_ranges.end(),
+                               std::make_pair(iaddr, UINT64_MAX));
+    if (it == pc_ranges.begin() || iaddr >= std::prev(it)->second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t trace_filter_t::apply(uint64_t *buf, size_t bytes, int max_core_ipc) {
+  const int max_consider = std::min(max_core_ipc, 7);
+  uint64_t *out = buf;
+
+  for (size_t i = 0; i < (bytes / sizeof(uint64_t)); i += 8) {
+    uint64_t *token = buf + i;
+    bool any_valid = false;
+    for (int q = 0; q < max_consider; q++) {
+      uint64_t &word = token[q + 1];
+      if (!(word & tracerv_t::valid_mask)) {
+        continue;
+      }
+      if (keep(word)) {
+        any_valid = true;
+      } else {
+        word &= ~tracerv_t::valid_mask;
+        dropped++;
+      }
+    }
+
+    if (any_valid) {
+      if (out != token) {
+        memmove(out, token, 8 * sizeof(uint64_t));
+      }
+      out += 8;
+    }
+  }
+  return (out - buf) * sizeof(uint64_t);
+}
@@ -0,0 +1,51 @@
+#ifndef __TRACE_FILTER_H
+#define __TRACE_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Host-side filter applied to TracerV tokens before they are serialized.
+ *
+ * An instruction is kept only if it passes every configured rule:
+ *  - its address falls in one of the PC ranges, which are given directly or
+ *    resolved from symbol names through the DWARF info of an ELF
+ *  - its privilege level is in the allowed set
+ * Instructions that fail lose their valid bit, and tokens left with no
+ * valid instruction are dropped altogether.
+ */
+class trace_filter_t {
+public:
+  // parses "<lo>-<hi>[,<lo>-<hi>...]", hex, as an inclusive-exclusive range
+  bool add_pc_ranges(const std::string &spec);
+  // Adds the address range of every subroutine named in the comma-separated
+  // list. Returns the names that could not be found.
+  std::vector<std::string> add_symbols(const std::string &spec,
+                                       const std::string &binary_with_dwarf);
+  // parses any combination of 'u', 's' and 'm'
+  bool set_privileges(const std::string &spec);
+
+  bool enabled() const { return !pc_ranges.empty() || priv_mask != 0; }
+  bool filters_privilege() const { return priv_mask != 0; }
+
+  // Filters the tokens of buf in place, compacting the kept ones to its
+  // front. Returns the bytes kept.
+  size_t apply(uint64_t *buf, size_t bytes, int max_core_ipc);
+
+  uint64_t instructions_dropped() const { return dropped; }
+
+private:
+  bool keep(uint64_t word) const;
+
+  // sorted by start
+  std::vector<std::pair<uint64_t, uint64_t>> pc_ranges;
+  // bit n set if privilege level n is allowed, 0 if unrestricted
+  uint32_t priv_mask = 0;
+
+  uint64_t dropped = 0;
+};
+
+#endif // __TRACE_FILTER_H
@@ -0,0 +1,73 @@
+#ifndef __TRACE_FORMAT_H
+#define __TRACE_FORMAT_H
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// Table-driven formatting of the human-readable and test TracerV outputs,
+// shared by the per-bridge writer and the merged writer
+
+// Two-character renderings of every byte in hex and of 0-99 in decimal
+struct trace_digit_tables_t {
+  char hex[256][2];
+  char dec[100][2];
+
+  constexpr trace_digit_tables_t() : hex(), dec() {
+    const char *digits = "0123456789abcdef";
+    for (int i = 0; i < 256; i++) {
+      hex[i][0] = digits[i >> 4];
+      hex[i][1] = digits[i & 0xf];
+    }
+    for (int i = 0; i < 100; i++) {
+      dec[i][0] = '0' + i / 10;
+      dec[i][1] = '0' + i % 10;
+    }
+  }
+};
+constexpr trace_digit_tables_t trace_digit_tables;
+
+// Longest test output line, one per token
+constexpr size_t TRACE_TEST_LINE_BYTES = 8 * 16 + 1;
+// "Cycle: " + cycle + " I" + lane + ": " + 16 hex digits + "\n", where a
+// cycle that does not fit in 16 digits can take up to 20 characters
+constexpr size_t TRACE_HUMAN_LINE_BYTES = 7 + 20 + 2 + 1 + 2 + 16 + 1;
+
+// Same as "%016" PRIx64
+inline char *put_hex16(char *p, uint64_t val) {
+  for (int byte = 7; byte >= 0; byte--) {
+    memcpy(p, trace_digit_tables.hex[(val >> (byte * 8)) & 0xff], 2);
+    p += 2;
+  }
+  return p;
+}
+
+// Same as "%016" PRId64
+inline char *put_dec16(char *p, uint64_t val) {
+  constexpr int64_t limit = 10000000000000000LL; // 10^16
+  if ((int64_t)val < 0 || (int64_t)val >= limit) {
+    return p + sprintf(p, "%016" PRId64, (int64_t)val);
+  }
+  for (int pair = 7; pair >= 0; pair--) {
+    memcpy(p + pair * 2, trace_digit_tables.dec[val % 100], 2);
+    val /= 100;
+  }
+  return p + 16;
+}
+
+// One human-readable line for instruction lane q of a token, which must
+// have TRACE_HUMAN_LINE_BYTES of room
+inline char *put_human_line(char *p, uint64_t cycle, int q, uint64_t instr) {
+  memcpy(p, "Cycle: ", 7);
+  p = put_dec16(p + 7, cycle);
+  memcpy(p, " I", 2);
+  p[2] = '0' + q;
+  memcpy(p + 3, ": ", 2);
+  p = put_hex16(p + 5, instr);
+  *p++ = '\n';
+  return p;
+}
+
+#endif // __TRACE_FORMAT_H
@@ -0,0 +1,171 @@
+#include "trace_merger.h"
+#include "trace_format.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+// tokens buffered per bridge (64B each)
+#define RING_TOKENS (16 << 10)
+// merged output is written out in chunks of about this size
+#define OUTBUF_BYTES (1 << 20)
+
+static constexpr uint64_t valid_mask = (1ULL << 63);
+
+std::shared_ptr<trace_merger_t>
+trace_merger_t::attach(const std::string &filename,
+                       const std::string &header,
+                       bool human_readable) {
+  // bridges hold the only strong references, the merger goes away with
+  // the last of them
+  static std::weak_ptr<trace_merger_t> shared;
+  std::shared_ptr<trace_merger_t> merger = shared.lock();
+  if (!merger) {
+    merger =
+        std::make_shared<trace_merger_t>(filename, header, human_readable);
+    shared = merger;
+  } else if (merger->filename != filename ||
+             merger->human_readable != human_readable) {
+    fprintf(stderr,
+            "All merged TracerV bridges must use the same +tracefile and "
+            "+trace-output-format\n");
+    abort();
+  }
+  return merger;
+}
+
+trace_merger_t::trace_merger_t(const std::string &filename,
+                               const std::string &header,
+                               bool human_readable)
+    : filename(filename), human_readable(human_readable) {
+  this->file = fopen(filename.c_str(), "w");
+  if (!this->file) {
+    fprintf(stderr, "Could not open merged trace file: %s\n", filename.c_str());
+    abort();
+  }
+  fputs(header.c_str(), this->file);
+  outbuf.reserve(OUTBUF_BYTES + 512);
+}
+
+trace_merger_t::~trace_merger_t() {
+  while (emit_oldest())
+    ;
+  flush_output();
+  fclose(this->file);
+  if (late_tokens) {
+    fprintf(stderr,
+            "TracerV: %" PRIu64 " merged tokens were written out of cycle "
+            "order, a bridge's buffer filled while another was idle\n",
+            late_tokens);
+  }
+}
+
+size_t trace_merger_t::add_source(int core_id, int max_core_ipc) {
+  source_t src;
+  src.core_id = core_id;
+  src.prefix = "Core: " + std::to_string(core_id) + " ";
+  src.max_consider = std::min(max_core_ipc, 7);
+  src.ring.resize(RING_TOKENS);
+  sources.push_back(std::move(src));
+  return sources.size() - 1;
+}
+
+void trace_merger_t::push(size_t source,
+                          const uint64_t *tokens,
+                          size_t bytes) {
+  for (size_t i = 0; i < (bytes / sizeof(uint64_t)); i += 8) {
+    source_t &src = sources[source];
+    // forced progress, see the class comment. The oldest token may belong
+    // to another source, so keep going until this ring has a free slot.
+    while (src.count == src.ring.size()) {
+      emit_oldest();
+    }
+    token_t &slot = src.ring[(src.head + src.count) % src.ring.size()];
+    memcpy(slot.data(), tokens + i, sizeof(token_t));
+    src.count++;
+  }
+  emit_ready();
+}
+
+void trace_merger_t::finish_source(size_t source) {
+  sources[source].finished = true;
+  emit_ready();
+  flush_output();
+}
+
+bool trace_merger_t::emit_oldest() {
+  source_t *oldest = nullptr;
+  for (auto &src : sources) {
+    if (src.count && (!oldest || src.ring[src.head][0] <
+                                     oldest->ring[oldest->head][0])) {
+      oldest = &src;
+    }
+  }
+  if (!oldest) {
+    return false;
+  }
+
+  const token_t &token = oldest->ring[oldest->head];
+  if (token[0] < last_cycle) {
+    late_tokens++;
+  } else {
+    last_cycle = token[0];
+  }
+  write_token(*oldest, token);
+  oldest->head = (oldest->head + 1) % oldest->ring.size();
+  oldest->count--;
+  return true;
+}
+
+void trace_merger_t::emit_ready() {
+  while (true) {
+    for (const auto &src : sources) {
+      // an unfinished source with nothing buffered may still send an
+      // older token
+      if (!src.count && !src.finished) {
+        return;
+      }
+    }
+    if (!emit_oldest()) {
+      return;
+    }
+  }
+}
+
+void trace_merger_t::write_token(const source_t &src, const token_t &token) {
+  if (human_readable) {
+    // the per-bridge format, behind the core ID
+    for (int q = 0; q < src.max_consider; q++) {
+      if (token[q + 1] & valid_mask) {
+        size_t at = outbuf.size();
+        outbuf.resize(at + src.prefix.size() + TRACE_HUMAN_LINE_BYTES);
+        char *p = outbuf.data() + at;
+        memcpy(p, src.prefix.data(), src.prefix.size());
+        p = put_human_line(p + src.prefix.size(),
+                           token[0],
+                           q,
+                           token[q + 1] & (~valid_mask));
+        outbuf.resize(p - outbuf.data());
+      }
+    }
+  } else {
+    // the core ID word followed by the binary format's record
+    uint64_t core_id = src.core_id;
+    const char *id = (const char *)&core_id;
+    const char *record = (const char *)token.data();
+    outbuf.insert(outbuf.end(), id, id + sizeof(uint64_t));
+    outbuf.insert(outbuf.end(),
+                  record,
+                  record + (1 + src.max_consider) * sizeof(uint64_t));
+  }
+
+  if (outbuf.size() >= OUTBUF_BYTES) {
+    flush_output();
+  }
+}
+
+void trace_merger_t::flush_output() {
+  fwrite(outbuf.data(), 1, outbuf.size(), this->file);
+  outbuf.clear();
+}
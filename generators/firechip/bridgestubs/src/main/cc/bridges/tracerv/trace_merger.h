@@ -0,0 +1,80 @@
+#ifndef __TRACE_MERGER_H
+#define __TRACE_MERGER_H
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Shared writer that merges the token streams of several TracerV bridges
+ * into a single file ordered by cycle (+trace-merge).
+ *
+ * Each bridge is a source with a bounded ring of tokens. A k-way merge
+ * emits the oldest buffered token whenever every unfinished source has at
+ * least one token buffered, so that nothing older can still arrive. If a
+ * source's ring fills while another source is idle, the oldest tokens are
+ * emitted anyway to keep memory bounded; a token that then arrives older
+ * than one already written is counted as late.
+ *
+ * Cycles are compared as-is, so the merged bridges should share a clock
+ * domain.
+ *
+ * There is no writer thread: each bridge pushes its tokens and the merge
+ * and file writes happen synchronously, on the simulation thread, in
+ * push() and finish_source().
+ */
+class trace_merger_t {
+public:
+  // Returns the merger shared by all bridges, creating it on first use
+  static std::shared_ptr<trace_merger_t> attach(const std::string &filename,
+                                                const std::string &header,
+                                                bool human_readable);
+
+  trace_merger_t(const std::string &filename,
+                 const std::string &header,
+                 bool human_readable);
+  // Writes out everything still buffered
+  ~trace_merger_t();
+
+  // Registers a bridge; core_id is written with each of its records
+  size_t add_source(int core_id, int max_core_ipc);
+  void push(size_t source, const uint64_t *tokens, size_t bytes);
+  // Marks a source as drained, so the merge no longer waits on it
+  void finish_source(size_t source);
+
+private:
+  using token_t = std::array<uint64_t, 8>;
+
+  struct source_t {
+    int core_id;
+    // "Core: <id> ", put in front of each human-readable line
+    std::string prefix;
+    int max_consider;
+    bool finished = false;
+    // ring of tokens, oldest at head
+    std::vector<token_t> ring;
+    size_t head = 0;
+    size_t count = 0;
+  };
+
+  // emits the oldest token, returns false if nothing is buffered
+  bool emit_oldest();
+  // emits tokens for as long as the merge order is known
+  void emit_ready();
+  void write_token(const source_t &src, const token_t &token);
+  void flush_output();
+
+  std::string filename;
+  FILE *file;
+  bool human_readable;
+  std::vector<source_t> sources;
+  std::vector<char> outbuf;
+
+  uint64_t last_cycle = 0;
+  uint64_t late_tokens = 0;
+};
+
+#endif // __TRACE_MERGER_H
@@ -1,16 +1,228 @@
 #include "trace_tracker.h"
 
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+
 //#define TRACETRACKER_LOG_PC_REGION
 
-TraceTracker::TraceTracker(std::string binary_with_dwarf, FILE *tracefile) {
+// labels are staged in a buffer of this size and written out when it fills
+#define OUTBUF_BYTES (1 << 20)
+// typical call depth, the stack only grows beyond this for deep recursion
+#define LABEL_STACK_RESERVE 256
+
+TraceTracker::TraceTracker(std::string binary_with_dwarf,
+                           FILE *tracefile,
+                           bool aggregate)
+    : outbuf(aggregate ? 0 : OUTBUF_BYTES), aggregate(aggregate) {
   this->bin_dump = new ObjdumpedBinary(binary_with_dwarf);
   this->tracefile = tracefile;
+  this->last_instr = nullptr;
+  this->label_stack.reserve(LABEL_STACK_RESERVE);
+  // root of the call-stack tree
+  this->stack_nodes.push_back({0, 0, 0});
+}
+
+TraceTracker::~TraceTracker() {
+  flush();
+  delete this->bin_dump;
+}
+
+void TraceTracker::flush() {
+  if (this->outpos) {
+    fwrite(this->outbuf.data(), 1, this->outpos, this->tracefile);
+    this->outpos = 0;
+  }
+}
+
+void TraceTracker::emit(const char *str, size_t len) {
+  if (this->outpos + len > this->outbuf.size()) {
+    flush();
+    if (len > this->outbuf.size()) {
+      fwrite(str, 1, len, this->tracefile);
+      return;
+    }
+  }
+  memcpy(this->outbuf.data() + this->outpos, str, len);
+  this->outpos += len;
+}
+
+void TraceTracker::emitU64(uint64_t val) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[sizeof(digits) - ++n] = '0' + (val % 10);
+    val /= 10;
+  } while (val);
+  emit(digits + sizeof(digits) - n, n);
+}
+
+void TraceTracker::pre_print(const LabelMeta &meta) {
+#ifdef INDENT_SPACES
+  for (uint64_t i = 0; i < meta.indent; i++) {
+    emit(" ", 1);
+  }
+  emit("Start label: ", 13);
+  emit(this->bin_dump->getFunctionName(meta.label));
+  emit(" at ", 4);
+  emitU64(meta.start_cycle);
+  emit(" cycles.\n", 9);
+#else
+  emit("Indent: ", 8);
+  emitU64(meta.indent);
+  emit(", Start label: ", 15);
+  emit(this->bin_dump->getFunctionName(meta.label));
+  emit(", At cycle: ", 12);
+  emitU64(meta.start_cycle);
+  emit("\n", 1);
+#endif
+}
+
+void TraceTracker::post_print(const LabelMeta &meta) {
+#ifdef INDENT_SPACES
+  for (uint64_t i = 0; i < meta.indent; i++) {
+    emit(" ", 1);
+  }
+  emit("End label: ", 11);
+  emit(this->bin_dump->getFunctionName(meta.label));
+  emit(" at ", 4);
+  emitU64(meta.end_cycle);
+  emit(" cycles.\n", 9);
+#else
+  emit("Indent: ", 8);
+  emitU64(meta.indent);
+  emit(", End label: ", 13);
+  emit(this->bin_dump->getFunctionName(meta.label));
+  emit(", End cycle: ", 13);
+  emitU64(meta.end_cycle);
+  emit("\n", 1);
+#endif
+}
+
+void TraceTracker::pushLabel(uint32_t label,
+                             bool asm_sequence,
+                             uint64_t cycle) {
+  LabelMeta new_label;
+  new_label.label = label;
+  new_label.asm_sequence = asm_sequence;
+  new_label.start_cycle = cycle;
+  new_label.end_cycle = cycle;
+  new_label.indent = label_stack.size() + 1;
+  if (aggregate) {
+    uint32_t parent = label_stack.empty() ? 0 : label_stack.back().node;
+    new_label.node = childNode(parent, label);
+    if (label >= function_calls.size()) {
+      function_calls.resize(label + 1, 0);
+    }
+    function_calls[label]++;
+  } else {
+    new_label.node = 0;
+  }
+  label_stack.push_back(new_label);
+  if (!aggregate) {
+    pre_print(new_label);
+  }
+}
+
+void TraceTracker::popLabel() {
+  if (!aggregate) {
+    post_print(label_stack.back());
+  }
+  label_stack.pop_back();
+}
+
+uint32_t TraceTracker::childNode(uint32_t parent, uint32_t function_id) {
+  uint64_t key = ((uint64_t)parent << 32) | function_id;
+  auto it = stack_children.emplace(key, stack_nodes.size());
+  if (it.second) {
+    stack_nodes.push_back({function_id, parent, 0});
+  }
+  return it.first->second;
+}
+
+// The folded format separates frames with ';' and the count with a space
+static std::string folded_frame(const std::string &name) {
+  std::string frame = name;
+  for (auto &c : frame) {
+    if (c == ';' || isspace((unsigned char)c)) {
+      c = '_';
+    }
+  }
+  return frame;
+}
+
+void TraceTracker::writeAggregate(FILE *folded, FILE *table) {
+  if (!aggregate) {
+    return;
+  }
+
+  const size_t num_functions = function_calls.size();
+  std::vector<uint64_t> inclusive(num_functions, 0);
+  std::vector<uint64_t> exclusive(num_functions, 0);
+  // last node that credited each function, so that recursive stacks only
+  // count towards a function's inclusive cycles once
+  std::vector<uint32_t> credited_by(num_functions, 0);
+  std::vector<uint32_t> path;
+
+  for (uint32_t n = 1; n < stack_nodes.size(); n++) {
+    const uint64_t cycles = stack_nodes[n].self_cycles;
+    if (cycles == 0) {
+      continue;
+    }
+
+    path.clear();
+    for (uint32_t cur = n; cur != 0; cur = stack_nodes[cur].parent) {
+      path.push_back(stack_nodes[cur].function_id);
+    }
+
+    std::string stack;
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      if (!stack.empty()) {
+        stack += ';';
+      }
+      stack += folded_frame(bin_dump->getFunctionName(*it));
+      if (credited_by[*it] != n) {
+        credited_by[*it] = n;
+        inclusive[*it] += cycles;
+      }
+    }
+    exclusive[stack_nodes[n].function_id] += cycles;
+    fprintf(folded, "%s %" PRIu64 "\n", stack.c_str(), cycles);
+  }
+
+  std::vector<uint32_t> order;
+  for (uint32_t f = 0; f < num_functions; f++) {
+    if (function_calls[f]) {
+      order.push_back(f);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return inclusive[a] > inclusive[b];
+  });
+
+  fprintf(table, "function,inclusive_cycles,exclusive_cycles,calls\n");
+  for (uint32_t f : order) {
+    fprintf(table,
+            "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            bin_dump->getFunctionName(f).c_str(),
+            inclusive[f],
+            exclusive[f],
+            function_calls[f]);
+  }
+
+  if (stack_zeroed_warnings) {
+    fprintf(stderr,
+            "FirePerf: call stack unwound to empty %" PRIu64
+            " times while looking for a label\n",
+            stack_zeroed_warnings);
+  }
 }
 
 void TraceTracker::addInstruction(uint64_t inst_addr, uint64_t cycle) {
   Instr *this_instr = this->bin_dump->getInstrFromAddr(inst_addr);
 
 #ifdef TRACETRACKER_LOG_PC_REGION
+  flush();
   if (!this_instr) {
     fprintf(
         this->tracefile, "addr:%" PRIx64 ", fn:%s\n", inst_addr, "USERSPACE");
@@ -23,88 +235,63 @@ void TraceTracker::addInstruction(uint64_t inst_addr, uint64_t cycle) {
   return;
 #endif
 
+  if (aggregate) {
+    // the cycles since the last instruction belong to the stack it ran in
+    if (!label_stack.empty()) {
+      stack_nodes[label_stack.back().node].self_cycles += cycle - last_cycle;
+    }
+    last_cycle = cycle;
+  }
+
   if (!this_instr) {
     if ((label_stack.size() == 1) &&
-        (std::string("USERSPACE_ALL")
-             .compare(label_stack[label_stack.size() - 1]->label) == 0)) {
-      LabelMeta *last_label = label_stack[label_stack.size() - 1];
-      last_label->end_cycle = cycle;
+        (label_stack.back().label == ObjdumpedBinary::USERSPACE_ALL)) {
+      label_stack.back().end_cycle = cycle;
     } else {
       while (label_stack.size() > 0) {
-        LabelMeta *pop_label = label_stack[label_stack.size() - 1];
-        label_stack.pop_back();
-        pop_label->post_print(this->tracefile);
-        delete pop_label;
+        popLabel();
         if (label_stack.size() > 0) {
-          LabelMeta *last_label = label_stack[label_stack.size() - 1];
-          last_label->end_cycle = cycle;
+          label_stack.back().end_cycle = cycle;
         }
       }
-      LabelMeta *new_label = new LabelMeta();
-      new_label->label = std::string("USERSPACE_ALL");
-      new_label->start_cycle = cycle;
-      new_label->end_cycle = cycle;
-      new_label->indent = label_stack.size() + 1;
-      new_label->asm_sequence = false;
-      label_stack.push_back(new_label);
-      new_label->pre_print(this->tracefile);
+      pushLabel(ObjdumpedBinary::USERSPACE_ALL, false, cycle);
     }
   } else {
-    std::string label = this_instr->function_name;
+    uint32_t label = this_instr->function_id;
 
     if ((label_stack.size() > 0) &&
-        (std::string("USERSPACE_ALL")
-             .compare(label_stack[label_stack.size() - 1]->label) == 0)) {
-      LabelMeta *pop_label = label_stack[label_stack.size() - 1];
-      label_stack.pop_back();
-      pop_label->post_print(this->tracefile);
-      delete pop_label;
+        (label_stack.back().label == ObjdumpedBinary::USERSPACE_ALL)) {
+      popLabel();
     }
 
-    if ((label_stack.size() > 0) &&
-        (label.compare(label_stack[label_stack.size() - 1]->label) == 0)) {
-      LabelMeta *last_label = label_stack[label_stack.size() - 1];
-      last_label->end_cycle = cycle;
+    if ((label_stack.size() > 0) && (label_stack.back().label == label)) {
+      label_stack.back().end_cycle = cycle;
     } else {
       if ((label_stack.size() > 0) and this_instr->in_asm_sequence and
-          label_stack[label_stack.size() - 1]->asm_sequence) {
-
-        LabelMeta *pop_label = label_stack[label_stack.size() - 1];
-        label_stack.pop_back();
-        pop_label->post_print(this->tracefile);
-        delete pop_label;
-
-        LabelMeta *new_label = new LabelMeta();
-        new_label->label = label;
-        new_label->start_cycle = cycle;
-        new_label->end_cycle = cycle;
-        new_label->indent = label_stack.size() + 1;
-        new_label->asm_sequence = this_instr->in_asm_sequence;
-        label_stack.push_back(new_label);
-        new_label->pre_print(this->tracefile);
+          label_stack.back().asm_sequence) {
+        popLabel();
+        pushLabel(label, this_instr->in_asm_sequence, cycle);
       } else if ((label_stack.size() > 0) and
                  (this_instr->is_callsite or !(this_instr->is_fn_entry))) {
         uint64_t unwind_start_level = (uint64_t)(-1);
-        while (
-            (label_stack.size() > 0) and
-            (label_stack[label_stack.size() - 1]->label.compare(label) != 0)) {
-          LabelMeta *pop_label = label_stack[label_stack.size() - 1];
-          label_stack.pop_back();
-          pop_label->post_print(this->tracefile);
+        while ((label_stack.size() > 0) and
+               (label_stack.back().label != label)) {
           if (unwind_start_level == (uint64_t)(-1)) {
-            unwind_start_level = pop_label->indent;
+            unwind_start_level = label_stack.back().indent;
           }
-          delete pop_label;
+          popLabel();
           if (label_stack.size() > 0) {
-            LabelMeta *last_label = label_stack[label_stack.size() - 1];
-            last_label->end_cycle = cycle;
+            label_stack.back().end_cycle = cycle;
           }
         }
-        if (label_stack.size() == 0) {
+        if (label_stack.size() == 0 && aggregate) {
+          stack_zeroed_warnings++;
+        } else if (label_stack.size() == 0) {
+          flush();
           fprintf(this->tracefile,
                   "WARN: STACK ZEROED WHEN WE WERE LOOKING FOR LABEL: %s, "
                   "iaddr 0x%" PRIx64 "\n",
-                  label.c_str(),
+                  this_instr->function_name.c_str(),
                   inst_addr);
           fprintf(this->tracefile,
                   "WARN: is_callsite was: %d, is_fn_entry was: %d\n",
@@ -114,23 +301,25 @@ void TraceTracker::addInstruction(uint64_t inst_addr, uint64_t cycle) {
                   "WARN: Unwind started at level: dec %" PRIu64 "\n",
                   unwind_start_level);
           fprintf(this->tracefile, "WARN: Last instr was\n");
-          this->last_instr->printMeFile(this->tracefile, std::string("WARN: "));
+          if (this->last_instr) {
+            this->last_instr->printMeFile(this->tracefile,
+                                          std::string("WARN: "));
+          }
         }
       } else {
-        LabelMeta *new_label = new LabelMeta();
-        new_label->label = label;
-        new_label->start_cycle = cycle;
-        new_label->end_cycle = cycle;
-        new_label->indent = label_stack.size() + 1;
-        new_label->asm_sequence = this_instr->in_asm_sequence;
-        label_stack.push_back(new_label);
-        new_label->pre_print(this->tracefile);
+        pushLabel(label, this_instr->in_asm_sequence, cycle);
       }
     }
     this->last_instr = this_instr;
   }
 }
 
+void TraceTracker::addInstructions(const RetiredInstr *instrs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    addInstruction(instrs[i].iaddr, instrs[i].cycle);
+  }
+}
+
 #ifdef TRACERV_TOP_MAIN
 int main() {
   std::string tracefile = "/home/centos/trace2/TRACEFILE";
@@ -147,5 +336,6 @@ int main() {
     uint64_t cycle = (uint64_t)strtoull(cycle_str.c_str(), NULL, 16);
     t->addInstruction(addr, cycle);
   }
+  t->flush();
 }
 #endif
@@ -3,63 +3,81 @@
 
 #include "tracerv_processing.h"
 
+#include <unordered_map>
+
 //#define INDENT_SPACES
 
-class LabelMeta {
-public:
-  std::string label;
+// Plain-old-data stack entry; labels are interned function ids
+struct LabelMeta {
+  uint32_t label;
+  bool asm_sequence;
   uint64_t start_cycle;
   uint64_t end_cycle;
   uint64_t indent;
-  bool asm_sequence;
-
-  LabelMeta() { this->asm_sequence = false; }
-
-  void pre_print(FILE *tracefile) {
-#ifdef INDENT_SPACES
-    std::string ind(indent, ' ');
-    fprintf(tracefile,
-            "%sStart label: %s at %" PRIu64 " cycles.\n",
-            ind.c_str(),
-            label.c_str(),
-            start_cycle);
-#else
-    fprintf(tracefile,
-            "Indent: %" PRIu64 ", Start label: %s, At cycle: %" PRIu64 "\n",
-            indent,
-            label.c_str(),
-            start_cycle);
-#endif
-  }
+  // call-stack node for this label and everything below it
+  uint32_t node;
+};
 
-  void post_print(FILE *tracefile) {
-#ifdef INDENT_SPACES
-    std::string ind(indent, ' ');
-    fprintf(tracefile,
-            "%sEnd label: %s at %" PRIu64 " cycles.\n",
-            ind.c_str(),
-            label.c_str(),
-            end_cycle);
-#else
-    fprintf(tracefile,
-            "Indent: %" PRIu64 ", End label: %s, End cycle: %" PRIu64 "\n",
-            indent,
-            label.c_str(),
-            end_cycle);
-#endif
-  }
+// A retired instruction as handed over by tracerv_t
+struct RetiredInstr {
+  uint64_t iaddr;
+  uint64_t cycle;
 };
 
 class TraceTracker {
 private:
   ObjdumpedBinary *bin_dump;
-  std::vector<LabelMeta *> label_stack;
+  std::vector<LabelMeta> label_stack;
   FILE *tracefile;
   Instr *last_instr;
 
+  // output is staged here and written to tracefile in large chunks
+  std::vector<char> outbuf;
+  size_t outpos = 0;
+
+  // In aggregate mode no labels are printed; instead, cycles are charged to
+  // the call stack that was live when they elapsed, stored as a tree of
+  // StackNodes rooted at node 0.
+  struct StackNode {
+    uint32_t function_id;
+    uint32_t parent;
+    uint64_t self_cycles;
+  };
+  bool aggregate;
+  std::vector<StackNode> stack_nodes;
+  // (parent node << 32 | function id) -> child node
+  std::unordered_map<uint64_t, uint32_t> stack_children;
+  // times each function was entered, indexed by function id
+  std::vector<uint64_t> function_calls;
+  uint64_t last_cycle = 0;
+  uint64_t stack_zeroed_warnings = 0;
+
+  uint32_t childNode(uint32_t parent, uint32_t function_id);
+
+  void pushLabel(uint32_t label, bool asm_sequence, uint64_t cycle);
+  void popLabel();
+
+  void pre_print(const LabelMeta &meta);
+  void post_print(const LabelMeta &meta);
+  void emit(const char *str, size_t len);
+  void emit(const std::string &str) { emit(str.data(), str.size()); }
+  void emitU64(uint64_t val);
+
 public:
-  TraceTracker(std::string binary_with_dwarf, FILE *tracefile);
+  TraceTracker(std::string binary_with_dwarf,
+               FILE *tracefile,
+               bool aggregate = false);
+  ~TraceTracker();
   void addInstruction(uint64_t inst_addr, uint64_t cycle);
+  // Same as calling addInstruction on each, in order
+  void addInstructions(const RetiredInstr *instrs, size_t count);
+  // write out all buffered output
+  void flush();
+  // Aggregate mode only: writes one flamegraph-compatible folded stack line
+  // ("fn_a;fn_b;fn_c <cycles>") per call stack to folded, with ';' and
+  // whitespace in names replaced by '_', and a CSV of
+  // inclusive/exclusive cycles and calls per function to table.
+  void writeAggregate(FILE *folded, FILE *table);
 };
 
 #endif // __TRACE_TRACKER_H
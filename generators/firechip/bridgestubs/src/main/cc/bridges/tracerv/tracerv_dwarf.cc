@@ -50,12 +50,9 @@ dwarf_t::dwarf_t(Elf *elf) {
   }
 }
 
-void dwarf_t::subroutines(subroutine_map &table) {
-  if (this->dbg == nullptr) {
-    return;
-  }
+bool dwarf_t::next_unit() {
   Dwarf_Unsigned next_cu_offset;
-  while (dwarf_next_cu_header_c(this->dbg,
+  return dwarf_next_cu_header_c(this->dbg,
                                 1,       // is_info
                                 nullptr, // cu_header_length
                                 nullptr, // version_stamp
@@ -66,20 +63,47 @@ void dwarf_t::subroutines(subroutine_map &table) {
                                 nullptr, // signature
                                 nullptr, // typeoffset
                                 &next_cu_offset,
-                                nullptr) == DW_DLV_OK) {
+                                nullptr) == DW_DLV_OK;
+}
 
-    // Expect CU to have an initial DIE
-    Dwarf_Die die;
-    if (dwarf_siblingof(this->dbg, nullptr, &die, nullptr) != DW_DLV_OK) {
-      continue;
-    }
-    die_ptr die_wrap(die, dwarf_deleter(dbg));
+void dwarf_t::unit_subroutines(subroutine_map &table) {
+  // Expect CU to have an initial DIE
+  Dwarf_Die die;
+  if (dwarf_siblingof(this->dbg, nullptr, &die, nullptr) != DW_DLV_OK) {
+    return;
+  }
+  die_ptr die_wrap(die, dwarf_deleter(dbg));
 
-    if (dwarf_child(die, &die, nullptr) == DW_DLV_OK) {
-      die_wrap = die_ptr(die, dwarf_deleter(dbg));
-      // Enumerate subprograms
-      this->siblings(std::move(die_wrap), &dwarf_t::die_subprogram, table);
+  if (dwarf_child(die, &die, nullptr) == DW_DLV_OK) {
+    die_wrap = die_ptr(die, dwarf_deleter(dbg));
+    // Enumerate subprograms
+    this->siblings(std::move(die_wrap), &dwarf_t::die_subprogram, table);
+  }
+}
+
+void dwarf_t::subroutines(subroutine_map &table) {
+  if (this->dbg == nullptr) {
+    return;
+  }
+  while (this->next_unit()) {
+    this->unit_subroutines(table);
+  }
+}
+
+void dwarf_t::subroutines(
+    std::vector<std::pair<size_t, subroutine_map>> &units,
+    size_t stride,
+    size_t first) {
+  if (this->dbg == nullptr) {
+    return;
+  }
+  // walking the unit headers is cheap, only the DIEs are expensive
+  for (size_t unit = 0; this->next_unit(); unit++) {
+    if (unit % stride != first) {
+      continue;
     }
+    units.emplace_back(unit, subroutine_map());
+    this->unit_subroutines(units.back().second);
   }
 }
 
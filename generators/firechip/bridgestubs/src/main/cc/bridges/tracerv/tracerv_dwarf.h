@@ -6,6 +6,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 struct callsite_t {
@@ -41,11 +42,24 @@ public:
     }
   }
 
+  // False if the binary has no DWARF, in which case subroutines() finds
+  // nothing
+  bool has_debug_info() const { return this->dbg != nullptr; }
+
   void subroutines(subroutine_map &);
+  // Parses only the compile units whose index modulo stride is first, so
+  // that several dwarf_t instances can split a binary between them. Each
+  // unit's subroutines are returned along with the unit index.
+  void subroutines(std::vector<std::pair<size_t, subroutine_map>> &,
+                   size_t stride,
+                   size_t first);
 
 private:
   Dwarf_Debug dbg;
 
+  bool next_unit();
+  void unit_subroutines(subroutine_map &);
+
   // Encapsulate raw libdwarf pointers for memory management
   class dwarf_deleter;
   using die_ptr = std::unique_ptr<Dwarf_Die_s, dwarf_deleter>;
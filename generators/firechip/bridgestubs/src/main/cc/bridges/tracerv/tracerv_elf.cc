@@ -1,16 +1,20 @@
 #include "tracerv_elf.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdio>
 #include <cstring>
+#include <exception>
 #include <memory>
 #include <stdexcept>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include <elf.h>
 #include <gelf.h>
 #include <libelf.h>
+#include <sys/stat.h>
 
 namespace {
 void elf_runtime_error(const char *msg) {
@@ -29,7 +33,12 @@ inline void elf_version_init(void) {
 }
 } // namespace
 
-elf_t::elf_t(int fd) {
+// upper bound on DWARF worker threads. Each worker holds its own libdwarf
+// state, which for a kernel image runs to hundreds of MiB, so past a few
+// workers the memory cost outgrows the speedup.
+#define MAX_DWARF_THREADS 4u
+
+elf_t::elf_t(int fd) : fd(fd) {
   elf_version_init();
   this->elf = elf_begin(fd, ELF_C_READ, nullptr);
   if (this->elf == nullptr) {
@@ -37,7 +46,7 @@ elf_t::elf_t(int fd) {
   }
 }
 
-elf_t::elf_t(char *img, size_t size) {
+elf_t::elf_t(char *img, size_t size) : img(img), img_size(size) {
   elf_version_init();
   this->elf = elf_memory(img, size);
   if (this->elf == nullptr) {
@@ -73,12 +82,120 @@ void *elf_t::section_data(const char *name, size_t *size) {
   return nullptr;
 }
 
-std::pair<uint64_t, uint64_t> elf_t::subroutines(subroutine_map &table) {
-  {
+std::string elf_t::build_id() {
+  size_t size;
+  const uint8_t *note =
+      (const uint8_t *)this->section_data(".note.gnu.build-id", &size);
+  if (note == nullptr || size < 3 * sizeof(uint32_t)) {
+    return "";
+  }
+  uint32_t namesz, descsz;
+  memcpy(&namesz, note, sizeof(namesz));
+  memcpy(&descsz, note + sizeof(uint32_t), sizeof(descsz));
+  // the name ("GNU") is padded to 4 bytes
+  size_t desc = 3 * sizeof(uint32_t) + ((namesz + 3) & ~3);
+  if (descsz == 0 || desc + descsz > size) {
+    return "";
+  }
+
+  std::string id;
+  char hex[3];
+  for (size_t i = 0; i < descsz; i++) {
+    snprintf(hex, sizeof(hex), "%02x", note[desc + i]);
+    id += hex;
+  }
+  return id;
+}
+
+subroutine_cache_key_t elf_t::cache_key() {
+  subroutine_cache_key_t key;
+  key.build_id = this->build_id();
+  key.size = this->img_size;
+  key.mtime = 0;
+  struct stat st;
+  if (this->fd >= 0 && fstat(this->fd, &st) == 0) {
+    key.size = st.st_size;
+    key.mtime = st.st_mtime;
+  }
+  return key;
+}
+
+bool elf_t::dwarf_subroutines(subroutine_map &table) {
+  unsigned threads =
+      std::min(std::thread::hardware_concurrency(), MAX_DWARF_THREADS);
+  if (threads <= 1) {
     dwarf_t dwarf(this->elf);
     dwarf.subroutines(table);
+    return dwarf.has_debug_info();
   }
 
+  // libdwarf handles are not thread-safe, so each worker opens its own Elf
+  // and walks every threads-th compile unit. The workers map the file
+  // rather than read it, so that they share one copy of the section data.
+  std::vector<std::vector<std::pair<size_t, subroutine_map>>> units(threads);
+  std::vector<std::exception_ptr> errors(threads);
+  std::vector<char> debug_info(threads, 0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      try {
+        Elf *elf = (this->fd >= 0)
+                       ? elf_begin(this->fd, ELF_C_READ_MMAP, nullptr)
+                       : elf_memory(this->img, this->img_size);
+        if (elf == nullptr) {
+          elf_runtime_error("elf_begin");
+        }
+        std::unique_ptr<Elf, int (*)(Elf *)> elf_wrap(elf, elf_end);
+        dwarf_t dwarf(elf);
+        debug_info[t] = dwarf.has_debug_info();
+        dwarf.subroutines(units[t], threads, t);
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  // merge in unit order, so that the first definition of an address wins
+  // just as it does in a serial walk
+  std::vector<std::pair<size_t, subroutine_map> *> ordered;
+  for (auto &worker_units : units) {
+    for (auto &unit : worker_units) {
+      ordered.push_back(&unit);
+    }
+  }
+  std::sort(ordered.begin(),
+            ordered.end(),
+            [](const std::pair<size_t, subroutine_map> *a,
+               const std::pair<size_t, subroutine_map> *b) {
+              return a->first < b->first;
+            });
+  for (auto *unit : ordered) {
+    for (auto &kv : unit->second) {
+      table.emplace(kv.first, std::move(kv.second));
+    }
+  }
+  return debug_info[0];
+}
+
+std::pair<uint64_t, uint64_t> elf_t::subroutines(subroutine_map &table) {
+  subroutine_cache_key_t key = this->cache_key();
+  std::pair<uint64_t, uint64_t> bounds;
+  if (!key.build_id.empty() && subroutine_cache_load(key, table, bounds)) {
+    return bounds;
+  }
+
+  // a stripped copy shares the build-id of the binary it was stripped from,
+  // so only a table built from DWARF is worth keeping
+  bool cacheable = this->dwarf_subroutines(table);
+
   size_t shnum;
   if (elf_getshdrnum(this->elf, &shnum) != 0) {
     elf_runtime_error("elf_getshdrnum");
@@ -169,5 +286,9 @@ std::pair<uint64_t, uint64_t> elf_t::subroutines(subroutine_map &table) {
       }
     }
   }
-  return std::make_pair(lowpc, highpc);
+  bounds = std::make_pair(lowpc, highpc);
+  if (!key.build_id.empty() && cacheable) {
+    subroutine_cache_store(key, table, bounds);
+  }
+  return bounds;
 }
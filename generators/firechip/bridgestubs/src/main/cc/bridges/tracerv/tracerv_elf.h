@@ -1,9 +1,11 @@
 #ifndef __TRACERV_ELF_H
 #define __TRACERV_ELF_H
 
+#include "subroutine_cache.h"
 #include "tracerv_dwarf.h"
 #include <cstdint>
 #include <libelf.h>
+#include <string>
 #include <utility>
 
 class elf_t {
@@ -14,9 +16,20 @@ public:
 
   std::pair<uint64_t, uint64_t> subroutines(subroutine_map &);
   void *section_data(const char *, size_t *);
+  // hex GNU build-id, or empty if the binary has none
+  std::string build_id();
 
 private:
   Elf *elf;
+  // kept to open one more Elf descriptor per DWARF worker thread
+  int fd = -1;
+  char *img = nullptr;
+  size_t img_size = 0;
+
+  // Returns false if the binary has no DWARF
+  bool dwarf_subroutines(subroutine_map &);
+  // Identifies this particular file for the subroutine cache
+  subroutine_cache_key_t cache_key();
 };
 
 #endif // __TRACERV_ELF_H
@@ -2,12 +2,88 @@
 #include "tracerv_dwarf.h"
 #include "tracerv_elf.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdlib>
 #include <fcntl.h>
+#include <iterator>
+#include <map>
+#include <tuple>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+// Paints address ranges with labels. Earlier paints win: painting only
+// fills the gaps left between ranges that were already painted.
+class RangePainter {
+  // start -> (end, label)
+  std::map<uint64_t, std::pair<uint64_t, Instr *>> painted;
+
+public:
+  bool isPainted(uint64_t addr) const {
+    auto iter = painted.upper_bound(addr);
+    if (iter == painted.begin()) {
+      return false;
+    }
+    --iter;
+    return addr < iter->second.first;
+  }
 
-ObjdumpedBinary::ObjdumpedBinary(std::string binaryWithDwarf) {
+  // Fill the unpainted parts of [lo, hi) with the label returned by
+  // make_label(), which is only called if there is a gap. Returns the
+  // painted ranges that overlapped [lo, hi), in order.
+  template <typename F>
+  std::vector<std::pair<uint64_t, Instr *>>
+  paintGaps(uint64_t lo, uint64_t hi, F make_label) {
+    std::vector<std::pair<uint64_t, Instr *>> overlaps;
+    std::vector<std::pair<uint64_t, uint64_t>> gaps;
+    uint64_t cur = lo;
+    auto iter = painted.upper_bound(lo);
+    if (iter != painted.begin() && std::prev(iter)->second.first > lo) {
+      --iter;
+    }
+    for (; iter != painted.end() && iter->first < hi; ++iter) {
+      if (iter->first > cur) {
+        gaps.emplace_back(cur, iter->first);
+      }
+      overlaps.emplace_back(std::max(cur, iter->first), iter->second.second);
+      cur = std::max(cur, iter->second.first);
+    }
+    if (cur < hi) {
+      gaps.emplace_back(cur, hi);
+    }
+    if (!gaps.empty()) {
+      Instr *label = make_label();
+      for (const auto &gap : gaps) {
+        painted.emplace(gap.first, std::make_pair(gap.second, label));
+      }
+    }
+    return overlaps;
+  }
+
+  void paint(uint64_t addr, Instr *label) {
+    painted.emplace(addr, std::make_pair(addr + 1, label));
+  }
+
+  // Flatten into a sorted vector, merging adjacent ranges with one label
+  template <typename R>
+  void flatten(std::vector<R> &ranges) const {
+    ranges.clear();
+    for (const auto &kv : painted) {
+      if (!ranges.empty() && ranges.back().end == kv.first &&
+          ranges.back().instr == kv.second.second) {
+        ranges.back().end = kv.second.first;
+      } else {
+        ranges.push_back({kv.first, kv.second.first, kv.second.second});
+      }
+    }
+  }
+};
+} // namespace
+
+ObjdumpedBinary::ObjdumpedBinary(std::string binaryWithDwarf)
+    : function_names({"USERSPACE_ALL"}) {
   // annotate with dwarf information
   // fn names and callsites
   int fd = open(binaryWithDwarf.c_str(), O_RDONLY);
@@ -17,24 +93,22 @@ ObjdumpedBinary::ObjdumpedBinary(std::string binaryWithDwarf) {
   }
 
   subroutine_map table;
-  uint64_t base, limit;
+  uint64_t limit;
   {
     elf_t elf(fd);
-    std::tie(base, limit) = elf.subroutines(table);
+    std::tie(std::ignore, limit) = elf.subroutines(table);
   }
   close(fd);
 
-  if (!table.empty()) {
-    uint64_t addr = table.begin()->first;
-    this->baseaddr = (addr < base) ? addr : base;
-  } else {
-    this->baseaddr = base;
-  }
-  if (limit > this->baseaddr) {
-    this->progtext.resize(limit - this->baseaddr);
-  }
+  // end of the labelled image, unbounded labels extend up to here
+  uint64_t image_end = limit;
+
+  std::unordered_map<std::string, uint32_t> function_ids = {
+      {function_names[USERSPACE_ALL], USERSPACE_ALL}};
 
-  size_t offset = 0;
+  RangePainter painter;
+  // start of the gap that an unbounded label (prev) propagates into
+  uint64_t fill_from = 0;
   Instr *prev = nullptr;
   for (const auto &kv : table) {
     uint64_t pc_low = kv.first;
@@ -42,28 +116,23 @@ ObjdumpedBinary::ObjdumpedBinary(std::string binaryWithDwarf) {
 
     sub.print(pc_low);
 
-    size_t start = pc_low - this->baseaddr;
-    size_t end = (sub.pc_end > pc_low) ? (sub.pc_end - this->baseaddr) : start;
-    if (this->progtext.size() < end) {
-      this->progtext.resize(end);
-    }
+    uint64_t end = (sub.pc_end > pc_low) ? sub.pc_end : pc_low;
+    image_end = std::max(image_end, std::max(end, pc_low + 1));
 
     // Propagate previous unbounded label to start of current subroutine
     if (prev) {
-      Instr *body = nullptr;
-      for (; offset < start; offset++) {
-        if (this->progtext[offset] == nullptr) {
-          if (body == nullptr) {
-            body = new Instr(*prev);
-            body->is_fn_entry = false;
-          }
-          this->progtext[offset] = body;
-        }
+      if (fill_from < pc_low) {
+        painter.paintGaps(fill_from, pc_low, [prev] {
+          Instr *body = new Instr(*prev);
+          body->is_fn_entry = false;
+          return body;
+        });
       }
+      fill_from = std::max(fill_from, pc_low);
     }
 
     // Populate subroutine entry point
-    if (this->progtext[start] != nullptr) {
+    if (painter.isPainted(pc_low)) {
       fprintf(stderr,
               "subroutine overlap: %" PRIx64 " <%s>\n",
               pc_low,
@@ -73,9 +142,14 @@ ObjdumpedBinary::ObjdumpedBinary(std::string binaryWithDwarf) {
     Instr *entry = new Instr();
     entry->addr = pc_low; // FIXME: unused
     entry->function_name = sub.name;
+    auto id = function_ids.emplace(sub.name, function_names.size());
+    if (id.second) {
+      function_names.push_back(sub.name);
+    }
+    entry->function_id = id.first->second;
     entry->is_fn_entry = true;
     entry->in_asm_sequence = !sub.function;
-    this->progtext[start] = entry;
+    painter.paint(pc_low, entry);
 
     // Populate callsites
     Instr *target = nullptr;
@@ -87,24 +161,22 @@ ObjdumpedBinary::ObjdumpedBinary(std::string binaryWithDwarf) {
                 sub.name.c_str());
         continue;
       }
-      offset = site.pc - this->baseaddr;
       if (sub.pc_end != 0) {
-        if (offset >= end) {
+        if (site.pc >= end) {
           fprintf(stderr,
                   "callsite out of range: %" PRIx64 " <%s>\n",
                   site.pc,
                   sub.name.c_str());
           continue;
         }
-      } else if (offset >= this->progtext.size()) {
-        this->progtext.resize(offset + 1);
+      } else {
+        image_end = std::max(image_end, site.pc + 1);
       }
 
-      if (this->progtext[offset] != nullptr) {
-        uint64_t pc = this->baseaddr + offset;
+      if (painter.isPainted(site.pc)) {
         fprintf(stderr,
                 "callsite overlap: %" PRIx64 " <%s>\n",
-                pc,
+                site.pc,
                 sub.name.c_str());
         continue;
       }
@@ -114,54 +186,56 @@ ObjdumpedBinary::ObjdumpedBinary(std::string binaryWithDwarf) {
         target->is_fn_entry = false;
         target->is_callsite = true;
       }
-      this->progtext[offset] = target;
+      painter.paint(site.pc, target);
     }
 
     // Populate subroutine body
-    Instr *body = nullptr;
-    for (offset = start + 1; offset < end; offset++) {
-      Instr *insn = this->progtext[offset];
-      if (insn == nullptr) {
-        if (body == nullptr) {
-          body = new Instr(*entry);
-          body->is_fn_entry = false;
+    if (pc_low + 1 < end) {
+      auto overlaps = painter.paintGaps(pc_low + 1, end, [entry] {
+        Instr *body = new Instr(*entry);
+        body->is_fn_entry = false;
+        return body;
+      });
+      for (const auto &overlap : overlaps) {
+        if (overlap.second != target) {
+          fprintf(stderr,
+                  "subroutine overlap: %" PRIx64 " <%s>\n",
+                  overlap.first,
+                  sub.name.c_str());
         }
-        this->progtext[offset] = body;
-      } else if (insn != target) {
-        uint64_t pc = this->baseaddr + offset;
-        fprintf(stderr,
-                "subroutine overlap: %" PRIx64 " <%s>\n",
-                pc,
-                sub.name.c_str());
       }
     }
 
+    fill_from = std::max(pc_low + 1, end);
     prev = sub.pc_end ? nullptr : entry;
   }
   printf("\n");
 
   // Propagate previous unbounded label to end of image
-  if (prev) {
-    Instr *body = nullptr;
-    for (; offset < this->progtext.size(); offset++) {
-      if (this->progtext[offset] == nullptr) {
-        if (body == nullptr) {
-          body = new Instr(*prev);
-          body->is_fn_entry = false;
-        }
-        this->progtext[offset] = body;
-      }
-    }
+  if (prev && fill_from < image_end) {
+    painter.paintGaps(fill_from, image_end, [prev] {
+      Instr *body = new Instr(*prev);
+      body->is_fn_entry = false;
+      return body;
+    });
   }
+
+  painter.flatten(this->ranges);
 }
 
-Instr *ObjdumpedBinary::getInstrFromAddr(uint64_t lookupaddress) {
-  if (lookupaddress < this->baseaddr) {
+Instr *ObjdumpedBinary::lookupSlow(uint64_t lookupaddress) {
+  auto iter = std::upper_bound(
+      this->ranges.begin(),
+      this->ranges.end(),
+      lookupaddress,
+      [](uint64_t addr, const Range &range) { return addr < range.start; });
+  if (iter == this->ranges.begin()) {
     return NULL;
   }
-  uint64_t computeaddr = lookupaddress - this->baseaddr;
-  if (computeaddr >= this->progtext.size()) {
+  --iter;
+  if (lookupaddress >= iter->end) {
     return NULL;
   }
-  return this->progtext[computeaddr];
+  this->last_hit = iter - this->ranges.begin();
+  return iter->instr;
 }
@@ -16,11 +16,14 @@ public:
   uint64_t addr;
   std::string label;
   std::string function_name;
+  // interned function_name, see ObjdumpedBinary::getFunctionName
+  uint32_t function_id;
   bool is_fn_entry;
   bool is_callsite;
   bool in_asm_sequence;
 
   Instr() {
+    function_id = 0;
     is_callsite = false;
     is_fn_entry = false;
     in_asm_sequence = false;
@@ -34,13 +37,50 @@ public:
 };
 
 class ObjdumpedBinary {
-  // base address subtracted before lookup into array
-  uint64_t baseaddr;
-  std::vector<Instr *> progtext;
+  // [start, end) address range that maps to a single Instr
+  struct Range {
+    uint64_t start;
+    uint64_t end;
+    Instr *instr;
+  };
+
+  // sorted, non-overlapping ranges covering every labelled address
+  std::vector<Range> ranges;
+  // index of the last range hit, consecutive PCs usually hit it again
+  size_t last_hit = 0;
+
+  // function names indexed by their interned id
+  std::vector<std::string> function_names;
+
+  Instr *lookupSlow(uint64_t lookupaddress);
 
 public:
+  // reserved id for the pseudo-label covering all unlabelled code
+  static constexpr uint32_t USERSPACE_ALL = 0;
+
   ObjdumpedBinary(std::string binaryWithDwarf);
-  Instr *getInstrFromAddr(uint64_t lookupaddress);
+
+  const std::string &getFunctionName(uint32_t function_id) const {
+    return function_names[function_id];
+  }
+
+  Instr *getInstrFromAddr(uint64_t lookupaddress) {
+    if (last_hit < ranges.size()) {
+      const Range &hit = ranges[last_hit];
+      if (lookupaddress >= hit.start && lookupaddress < hit.end) {
+        return hit.instr;
+      }
+      // fall through into the next range
+      if (last_hit + 1 < ranges.size()) {
+        const Range &next = ranges[last_hit + 1];
+        if (lookupaddress >= next.start && lookupaddress < next.end) {
+          last_hit++;
+          return next.instr;
+        }
+      }
+    }
+    return lookupSlow(lookupaddress);
+  }
 };
 
 #endif // __TRACERV_PROCESSING_H
@@ -54,7 +54,7 @@ TARGET_CXX_FLAGS += \
 		-I$(firechip_lib_dir) \
 		-I$(firechip_lib_dir)/bridge \
 		-I$(firechip_lib_dir)/bridge/tracerv
-TARGET_LD_FLAGS += -l:libdwarf.so -l:libelf.so
+TARGET_LD_FLAGS += -l:libdwarf.so -l:libelf.so -lz
 
 # other
 TARGET_CXX_FLAGS += \
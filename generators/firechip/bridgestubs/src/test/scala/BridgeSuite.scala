@@ -61,33 +61,77 @@ class UARTF1Test extends UARTTest(BaseConfigs.F1)
 
 class BlockDevTest(targetConfig: BasePlatformConfig)
     extends BridgeSuite("BlockDevModule", "NoConfig", targetConfig) {
+
+  // Generate a random string spanning 2 sectors with a fixed seed.
+  val data = getTestString(1024)
+
+  /** Runs the DUT, which copies device 0 to device 1, with the given extra plusargs and returns the contents of the
+    * device 1 image afterwards.
+    */
+  def copy(backend: String, debug: Boolean, extraArgs: Seq[String] = Seq()): String = {
+    // Create an input file.
+    val input       = File.createTempFile("input", ".txt")
+    input.deleteOnExit()
+    val inputWriter = new BufferedWriter(new FileWriter(input))
+    inputWriter.write(data)
+    inputWriter.flush()
+    inputWriter.close()
+
+    // Pre-allocate space in the output.
+    val output       = File.createTempFile("output", ".txt")
+    output.deleteOnExit()
+    val outputWriter = new BufferedWriter(new FileWriter(output))
+    for (i <- 1 to data.size) {
+      outputWriter.write('x')
+    }
+    outputWriter.flush()
+    outputWriter.close()
+
+    val runResult =
+      run(backend, debug, args = Seq(s"+blkdev0=${input.getPath}", s"+blkdev1=${output.getPath}") ++ extraArgs)
+    assert(runResult == 0)
+    scala.io.Source.fromFile(output.getPath).mkString
+  }
+
+  // The writes to device 1 land in the overlay's delta file
+  def overlayArgs: Seq[String] = {
+    val delta = File.createTempFile("delta", ".img")
+    delta.deleteOnExit()
+    Seq(s"+blkdev-overlay1=${delta.getPath}")
+  }
+
   override def defineTests(backend: String, debug: Boolean) {
     it should "copy from one device to another" in {
-      // Generate a random string spanning 2 sectors with a fixed seed.
-      val data = getTestString(1024)
+      copy(backend, debug) should equal(data)
+    }
 
-      // Create an input file.
-      val input       = File.createTempFile("input", ".txt")
-      input.deleteOnExit()
-      val inputWriter = new BufferedWriter(new FileWriter(input))
-      inputWriter.write(data)
-      inputWriter.flush()
-      inputWriter.close()
+    it should "leave the image unchanged when its overlay is discarded" in {
+      copy(backend, debug, overlayArgs) should equal("x" * data.size)
+    }
 
-      // Pre-allocate space in the output.
-      val output       = File.createTempFile("output", ".txt")
-      output.deleteOnExit()
-      val outputWriter = new BufferedWriter(new FileWriter(output))
-      for (i <- 1 to data.size) {
-        outputWriter.write('x')
-      }
-      outputWriter.flush()
-      outputWriter.close()
+    it should "write the image when its overlay is committed" in {
+      copy(backend, debug, overlayArgs :+ "+blkdev-overlay-commit1=1") should equal(data)
+    }
 
-      val runResult = run(backend, debug, args = Seq(s"+blkdev0=${input.getPath}", s"+blkdev1=${output.getPath}"))
-      assert(runResult == 0)
-      val result    = scala.io.Source.fromFile(output.getPath).mkString
-      result should equal(data)
+    // Each host-side I/O mode must give the same result as the plain copy
+    val modes = Seq(
+      "write-back"     -> Seq("+blkdev-writeback0=1", "+blkdev-writeback1=1"),
+      "read-ahead"     -> Seq("+blkdev-readahead0=4", "+blkdev-readahead1=4"),
+      "worker threads" -> Seq("+blkdev-io-threads0=2", "+blkdev-io-threads1=2"),
+      "a mapped image" -> Seq("+blkdev-mmap0=1", "+blkdev-mmap1=1"),
+      "all of these"   -> Seq(
+        "+blkdev-writeback1=1",
+        "+blkdev-readahead0=4",
+        "+blkdev-io-threads0=2",
+        "+blkdev-io-threads1=2",
+        "+blkdev-mmap0=1",
+        "+blkdev-mmap1=1",
+      ),
+    )
+    for ((name, args) <- modes) {
+      it should s"copy from one device to another with ${name}" in {
+        copy(backend, debug, args) should equal(data)
+      }
     }
   }
 }
@@ -15,7 +15,13 @@ import firesim.lib.bridgeutils._
 import firechip.bridgeinterfaces._
 
 class BlockDevBridgeModule(blockDevExternal: BlockDeviceConfig)(implicit p: Parameters)
-extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
+extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p)
+    with StreamToHostCPU
+    with StreamFromHostCPU {
+  // Stream mixin parameters, in stream words. A 16-sector request is ~150 words.
+  val toHostCPUQueueDepth   = 1024
+  val fromHostCPUQueueDepth = 1024
+
   lazy val module = new BridgeModuleImp(this) {
     // TODO use HasBlockDeviceParameters
     val dataBytes = 512
@@ -26,6 +32,9 @@ extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
     val dataBeats = (dataBytes * 8) / dataBitsPerBeat // A transaction is thus dataBeats * len beats long
     // Timing parameters
     val latencyBits = 24
+    // Data beats travel over the streams packed into words holding a 64b
+    // header, {tag[63:32], nbeats[31:0]}, and up to this many beats of one tag
+    val beatsPerStreamWord = BridgeStreamConstants.streamWidthBits / dataBitsPerBeat - 1
     val defaultReadLatency = (1 << 8).U(latencyBits.W)
     val defaultWriteLatency = (1 << 8).U(latencyBits.W)
 
@@ -195,22 +204,56 @@ extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
     genROReg(reqBuf.io.deq.bits.tag, "bdev_req_tag")
     Pulsify(genWORegInit(reqBuf.io.deq.ready, "bdev_req_ready", false.B), pulseLength = 1)
 
-    // Functional data queue (to CPU)
-    genROReg(dataBuf.io.deq.valid, "bdev_data_valid")
-    genROReg(dataBuf.io.deq.bits.data(63, 32), "bdev_data_data_upper")
-    genROReg(dataBuf.io.deq.bits.data(31, 0), "bdev_data_data_lower")
-    genROReg(dataBuf.io.deq.bits.tag, "bdev_data_tag")
-    Pulsify(genWORegInit(dataBuf.io.deq.ready, "bdev_data_ready", false.B), pulseLength = 1)
+    // Functional data queue (to CPU stream)
+    // Beats are packed until the word is full, the tag changes, or the last
+    // beat of the write is reached, so the host never waits on a partial word.
+    // Tags are only reused once acked, so a tracker's count cannot be reloaded
+    // while its data is still being packed.
+    val packBeatsLeft = Reg(Vec(nTrackers, UInt(sectorBits.W)))
+    val packBeats = Reg(Vec(beatsPerStreamWord, UInt(dataBitsPerBeat.W)))
+    val packCount = RegInit(0.U(log2Ceil(beatsPerStreamWord + 1).W))
+    val packTag = Reg(UInt(tagBits.W))
+    val packFlush = RegInit(false.B)
+
+    when (tFire && target.req.fire && target.req.bits.write) {
+      packBeatsLeft(target.req.bits.tag) := dataBeats.U * target.req.bits.len
+    }
 
-    // Read reponse buffer MMIO IF (from CPU)
-    val rRespDataRegUpper = genWOReg(Wire(UInt((dataBitsPerBeat/2).W)),"bdev_rresp_data_upper")
-    val rRespDataRegLower = genWOReg(Wire(UInt((dataBitsPerBeat/2).W)),"bdev_rresp_data_lower")
-    val rRespTag          = genWOReg(Wire(UInt(tagBits.W)            ),"bdev_rresp_tag")
-    Pulsify(                genWORegInit(rRespBuf.io.enq.valid  ,"bdev_rresp_valid", false.B), pulseLength = 1)
-    genROReg(rRespBuf.io.enq.ready, "bdev_rresp_ready")
+    val dataTag = dataBuf.io.deq.bits.tag
+    dataBuf.io.deq.ready := !packFlush && (packCount === 0.U || dataTag === packTag)
+
+    streamEnq.valid := packFlush
+    streamEnq.bits := Cat(packBeats.reverse :+ Cat(packTag.pad(32), packCount.pad(32)))
+
+    when (streamEnq.fire) {
+      packCount := 0.U
+      packFlush := false.B
+    }.elsewhen (dataBuf.io.deq.fire) {
+      packBeats(packCount) := dataBuf.io.deq.bits.data
+      packCount := packCount + 1.U
+      packTag := dataTag
+      packBeatsLeft(dataTag) := packBeatsLeft(dataTag) - 1.U
+      packFlush := packCount === (beatsPerStreamWord - 1).U || packBeatsLeft(dataTag) === 1.U
+    }.elsewhen (dataBuf.io.deq.valid && packCount =/= 0.U && dataTag =/= packTag) {
+      packFlush := true.B
+    }
 
-    rRespBuf.io.enq.bits.data := Cat(rRespDataRegUpper, rRespDataRegLower)
-    rRespBuf.io.enq.bits.tag := rRespTag
+    // Read reponse buffer (from CPU stream)
+    // Each word is unpacked a beat at a time into rRespBuf
+    val unpackBeat = RegInit(0.U(log2Ceil(beatsPerStreamWord).W))
+    val unpackCount = streamDeq.bits(31, 0)
+    val unpackLast = unpackBeat === (unpackCount - 1.U)
+    val unpackBeats = VecInit.tabulate(beatsPerStreamWord)(i =>
+      streamDeq.bits(dataBitsPerBeat * (i + 2) - 1, dataBitsPerBeat * (i + 1)))
+
+    rRespBuf.io.enq.valid := streamDeq.valid
+    rRespBuf.io.enq.bits.data := unpackBeats(unpackBeat)
+    rRespBuf.io.enq.bits.tag := streamDeq.bits(32 + tagBits - 1, 32)
+    streamDeq.ready := rRespBuf.io.enq.ready && unpackLast
+
+    when (rRespBuf.io.enq.fire) {
+      unpackBeat := Mux(unpackLast, 0.U, unpackBeat + 1.U)
+    }
 
     // Write acknowledgement buffer MMIO IF (from CPU) -- we only need the tag from SW
     val wAckTag          = genWOReg(Wire(UInt(tagBits.W))            ,"bdev_wack_tag")
@@ -231,7 +274,15 @@ extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
           sb,
           "blockdev_t",
           "blockdev",
-          Seq(UInt32(nTrackers), UInt32(latencyBits))
+          Seq(
+            UInt32(nTrackers),
+            UInt32(latencyBits),
+            UInt32(toHostStreamIdx),
+            UInt32(toHostCPUQueueDepth),
+            UInt32(fromHostStreamIdx),
+            UInt32(fromHostCPUQueueDepth),
+          ),
+          hasStreams = true
       )
     }
   }
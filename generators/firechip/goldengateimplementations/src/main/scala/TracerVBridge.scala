@@ -35,6 +35,8 @@ class TracerVBridgeModule(key: TraceBundleWidths)(implicit p: Parameters)
     private val insnWidth = traces.map(_.insn.getWidth).max
     println(s"TracerVBridge: Max {Iaddr, Insn} Widths = {$pcWidth, $insnWidth}")
     require(pcWidth + 1 <= 64, "Instruction address + 1 bit (for valid) must fit in 64b (for SW-side of bridge)")
+    // The privilege level is only carried if it fits between valid and the address
+    private val privInTrace = pcWidth + 4 <= 64
     val cycleCountWidth   = 64
 
     // Set after trigger-dependent memory-mapped registers have been set, to
@@ -152,7 +154,14 @@ class TracerVBridgeModule(key: TraceBundleWidths)(implicit p: Parameters)
     val allTraceArms = traces.grouped(armWidth).toSeq
 
     // an intermediate value used to build allStreamBits
-    val allUintTraces = allTraceArms.map(arm => arm.map((trace => Cat(trace.valid, trace.iaddr.pad(63)))).reverse)
+    // each instruction is {valid, priv[2:0], iaddr[59:0]}, see tracerv_t::priv_shift,
+    // or {valid, iaddr[62:0]} for wider addresses
+    val allUintTraces = allTraceArms.map(arm =>
+      arm.map(trace =>
+        if (privInTrace) Cat(trace.valid, trace.priv, trace.iaddr.pad(60))
+        else Cat(trace.valid, trace.iaddr.pad(63))
+      ).reverse
+    )
 
     // Literally each arm of the mux, these are directly the bits that get put into the bump
     val allStreamBits =
@@ -217,6 +226,7 @@ class TracerVBridgeModule(key: TraceBundleWidths)(implicit p: Parameters)
           UInt32(toHostStreamIdx),
           UInt32(toHostCPUQueueDepth),
           UInt32(traces.size),
+          CppBoolean(privInTrace),
           Verbatim(clockDomainInfo.toC),
         ),
         hasStreams = true,
@@ -0,0 +1,157 @@
+/*
+ * Block device throughput benchmark
+ *
+ * Keeps up to a given number of requests in flight, issuing a new one as
+ * soon as a tag completes, and sweeps the request length, the queue depth
+ * and the fraction of writes. Requests walk the disk sequentially and wrap
+ * around at its end. Each configuration reports its elapsed cycles per
+ * request, the mean cycles from issue to completion, and MB/s at CPU_MHZ.
+ *
+ * The contents of the disk are overwritten.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mmio.h"
+#include "blkdev.h"
+
+// core clock used to convert cycles to MB/s, override with -DCPU_MHZ=
+#ifndef CPU_MHZ
+#define CPU_MHZ 1000
+#endif
+
+// largest request length and queue depth swept
+#define MAX_LEN 64
+#define MAX_DEPTH 16
+// bytes moved per configuration, but at least MIN_REQUESTS requests
+#define BENCH_BYTES (512 * 1024)
+#define MIN_REQUESTS 64
+
+#define SLOT_BYTES (MAX_LEN * BLKDEV_SECTOR_SIZE)
+
+// percentage of writes in each mix swept
+#define NUM_MIXES 3
+static const unsigned int write_pcts[NUM_MIXES] = {0, 50, 100};
+
+static unsigned char bufs[MAX_DEPTH][SLOT_BYTES] __attribute__ ((aligned (64)));
+
+static unsigned int slot_of_tag[256];
+static uint64_t issued_at[256];
+
+static unsigned int nsectors;
+
+// Read cycle counter
+static inline uint64_t read_cycles(void)
+{
+	uint64_t cycles;
+	asm volatile ("rdcycle %0" : "=r" (cycles));
+	return cycles;
+}
+
+// xorshift, so that every run issues the same mix
+static uint64_t rng_state = 0x9e3779b97f4a7c15UL;
+
+static inline unsigned int next_percent(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state % 100;
+}
+
+static void run(unsigned int len, unsigned int depth, unsigned int write_pct)
+{
+	unsigned long nreqs = BENCH_BYTES / (len * BLKDEV_SECTOR_SIZE);
+	unsigned long issued = 0, completed = 0;
+	unsigned int free_slots[MAX_DEPTH];
+	unsigned int nfree = depth;
+	unsigned int offset = 0;
+	uint64_t latency = 0, start, cycles;
+
+	if (nreqs < MIN_REQUESTS)
+		nreqs = MIN_REQUESTS;
+
+	for (unsigned int i = 0; i < depth; i++)
+		free_slots[i] = i;
+
+	start = read_cycles();
+
+	while (completed < nreqs) {
+		/* Top the queue up to depth requests */
+		while (issued < nreqs && nfree > 0 &&
+				reg_read8(BLKDEV_NREQUEST) > 0) {
+			unsigned int slot = free_slots[--nfree];
+			unsigned char write = next_percent() < write_pct;
+			uint64_t now = read_cycles();
+			unsigned int tag = blkdev_send_request(
+					(unsigned long) bufs[slot], offset,
+					len, write);
+
+			slot_of_tag[tag] = slot;
+			issued_at[tag] = now;
+			offset += len;
+			if (offset + len > nsectors)
+				offset = 0;
+			issued++;
+		}
+
+		/* Recycle the slots of whatever has completed */
+		while (reg_read8(BLKDEV_NCOMPLETE) > 0) {
+			unsigned int tag = reg_read8(BLKDEV_COMPLETE);
+
+			latency += read_cycles() - issued_at[tag];
+			free_slots[nfree++] = slot_of_tag[tag];
+			completed++;
+		}
+	}
+
+	cycles = read_cycles() - start;
+
+	unsigned long bytes = nreqs * len * BLKDEV_SECTOR_SIZE;
+	printf("%5u %6u %7u %9lu %12lu %9lu %9lu %7lu\n",
+			len, depth, write_pct, nreqs, cycles,
+			cycles / nreqs, latency / nreqs,
+			bytes * CPU_MHZ / cycles);
+}
+
+int main(void)
+{
+	unsigned int max_req_len = blkdev_max_req_len();
+	unsigned int ntags = reg_read8(BLKDEV_NREQUEST);
+
+	nsectors = blkdev_nsectors();
+
+	printf("blkdev: %u sectors %u max request length %u tags\n",
+			nsectors, max_req_len, ntags);
+
+	if (max_req_len > MAX_LEN)
+		max_req_len = MAX_LEN;
+	if (ntags > MAX_DEPTH)
+		ntags = MAX_DEPTH;
+
+	if (nsectors < 2 * max_req_len) {
+		printf("Error: blkdev nsectors not large enough: %u < %u\n",
+				nsectors, 2 * max_req_len);
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < MAX_DEPTH; i++) {
+		for (unsigned int j = 0; j < SLOT_BYTES; j++)
+			bufs[i][j] = i + j;
+	}
+
+	asm volatile ("fence");
+
+	printf("  len  depth  write%%  requests       cycles   cyc/req   "
+			"lat/req    MB/s\n");
+
+	for (unsigned int w = 0; w < NUM_MIXES; w++) {
+		for (unsigned int len = 1; len <= max_req_len; len *= 4) {
+			for (unsigned int depth = 1; depth <= ntags; depth *= 2)
+				run(len, depth, write_pcts[w]);
+		}
+	}
+
+	return 0;
+}